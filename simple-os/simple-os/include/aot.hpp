@@ -0,0 +1,147 @@
+//
+//  aot.hpp
+//
+// Provides ahead-of-time compilation of a loaded program image. The image
+// is split into basic blocks, each of which is translated into a C++
+// function that keeps the registers in locals and reads and writes memory
+// as a plain array. The source is compiled into a shared object that is
+// cached by a hash of the image, then loaded with dlopen so that the CPU
+// can call a block instead of interpreting it. Anything that a block
+// cannot handle on its own (Int, IRet, End, protection errors and writes
+// over translated code) is left to the interpreter.
+//
+
+#ifndef aot_hpp
+#define aot_hpp
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Bumped whenever AotState or the generated code changes, so that stale
+// shared objects in the cache are never loaded.
+const int AOT_ABI_VERSION = 1;
+
+// The registers as seen by a compiled block. The generated source declares
+// an identical struct, so both must change along with AOT_ABI_VERSION.
+struct AotState
+{
+    int PC, SP, AC, X, Y,
+        mode,       // KERNEL (0) or USER (1)
+        time,       // Instructions since the last timer interrupt
+        timer;      // Instructions allowed before a timer interrupt
+    int *mem;                   // The whole of memory
+    const unsigned char *code;  // Non-zero for every word that stores must leave to the interpreter
+};
+
+// What a compiled block asks the CPU to do once it returns.
+enum AOT_RESULT {AOT_CONTINUE=0, AOT_INTERPRET=1};
+
+typedef int (*AotBlockFn)(AotState *state);
+
+class AotProgram
+{
+private:
+    // A basic block, along with the address of every instruction in it.
+    struct Block
+    {
+        int start,
+            end;    // One past the last word (including operands)
+        std::vector<int> instructions;
+        AotBlockFn fn;
+        bool valid;
+    };
+
+    int *_mem;
+    int _size;
+    void *_library;
+    std::vector<Block> _blocks;
+    std::vector<int> _entry;            // Block containing each instruction address, or -1
+    std::vector<unsigned char> _code;   // Non-zero for every word that compiled stores must not touch
+
+    // Finds the basic blocks reachable from address 0 and both handlers.
+    void _analyze();
+
+    /**
+     * Writes out the C++ source for every block.
+     * @arg out: The file to write the source to.
+     */
+    void _emit(FILE *out) const;
+
+    /**
+     * Writes out the statements for a single instruction.
+     * @arg out: The file to write the source to.
+     * @arg pc: The address of the instruction.
+     * @arg last: Whether this is the final instruction in its block.
+     */
+    void _emit_instruction(FILE *out, int pc, bool last) const;
+
+    // A hash of the image, used to name the cached source and shared object.
+    std::string _image_hash() const;
+
+public:
+    long compiled_instructions,     // Instructions executed by compiled blocks
+         interpreted_instructions,  // Instructions executed by the interpreter
+         invalidations;             // Blocks discarded because the guest wrote over them
+
+    /**
+     * Prepares to compile a program image that lives in this process.
+     * @arg mem: The memory holding the loaded image.
+     * @arg size: The number of words of memory.
+     */
+    AotProgram(int *mem, int size);
+    ~AotProgram();
+
+    /**
+     * Translates the image, compiling it unless a cached copy exists, and
+     * loads the compiled blocks.
+     * @return: False if the blocks could not be compiled or loaded, in which
+     *          case every instruction is interpreted.
+     */
+    bool load();
+
+    /**
+     * Finds the compiled block for an instruction address.
+     * @arg pc: The address execution would continue from.
+     * @arg user: Whether the CPU is in user mode, where blocks that reach
+     *            into system memory cannot be used.
+     * @return: The block to call, or NULL if this address must be interpreted.
+     */
+    AotBlockFn lookup(int pc, bool user) const
+    {
+        if(pc < 0 || pc >= _size || _entry[pc] < 0)
+            return NULL;
+        const Block &block = _blocks[_entry[pc]];
+        if(!block.valid || (user && block.end > 1000))
+            return NULL;
+        return block.fn;
+    }
+
+    // Whether an address holds translated code or is otherwise guarded.
+    bool covers(int addr) const { return _code[addr] != 0; }
+
+    /**
+     * Makes compiled stores over a range of words go through the interpreter,
+     * such as code that the CPU has matched to a native handler.
+     * @arg addr: The first address to guard.
+     * @arg length: The number of words to guard.
+     */
+    void protect(int addr, int length);
+
+    /**
+     * Stops using every block that covers an address that has been written.
+     * @arg addr: The address that the guest wrote to.
+     */
+    void invalidate(int addr);
+
+    int *memory() { return _mem; }
+    const unsigned char *code_map() const { return &_code[0]; }
+
+    /**
+     * Prints how much of the run was spent in compiled code.
+     * @arg out: The stream to print the report to.
+     */
+    void report(FILE *out) const;
+};
+
+#endif /* aot_hpp */
@@ -0,0 +1,205 @@
+//
+//  batch.hpp
+//
+// Contains the batch engine, which runs many copies of the same program
+// image side by side as lanes, each with its own random seed. Lanes that
+// are waiting to run are parked at their PC. The lanes parked at the lowest
+// PC are gathered into a group whose registers are packed next to each
+// other in structure-of-arrays form, so that register arithmetic and
+// branches are done on whole vectors of lanes at a time. When the lanes in
+// a group branch differently or take an interrupt, the ones heading for the
+// lowest PC keep running and the rest are parked again until the group
+// catches up to them. Every lane has its own copy-on-write view of memory and
+// its own output.
+//
+
+#ifndef batch_hpp
+#define batch_hpp
+
+#include <string>
+#include <vector>
+
+#include "common_data.hpp"
+
+class BatchEngine
+{
+private:
+    // Memory is shared between lanes in pages, which a lane copies the
+    // first time it writes to them.
+    const static int PAGE_BITS = 6;
+    const static int PAGE_SIZE = 1 << PAGE_BITS;
+    const static int NUM_PAGES = (PARTITION_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // One bit for every address, set while any lane is parked there.
+    const static int WAIT_WORDS = (PARTITION_SIZE + 63) / 64;
+
+    // The registers of the lanes that are running together. Every lane in
+    // a group starts each instruction at the same PC, but may leave it for
+    // a different one.
+    struct Group
+    {
+        int size,
+            elapsed,    // Instructions run since time was last brought up to date
+            deadline;   // Instructions until the first lane's timer could expire
+        bool branched,  // Whether PC holds each lane's next PC
+             recheck;   // Whether a lane changed modes, so the timer must be checked
+        std::vector<int> lane,  // The lane in each slot, or -1 once it has stopped
+                         PC, SP, AC, X, Y, mode, time,
+                         op;    // Operands, when the lanes do not all share one
+        std::vector<unsigned> rng;
+    };
+
+    int _lanes,
+        _timer,     // The number of instructions that pass without timeout
+        _running,   // The number of lanes that have not yet ended
+        _lowest;    // The lowest PC that any parked lane is waiting at
+    long _groups,   // Instructions run by a group, however many lanes it held
+         _gathers;  // Times that parked lanes were gathered into a group
+    bool _stopped;  // Whether any lane in the group has stopped or left it
+
+    // The registers of parked lanes, with one entry per lane in each array.
+    std::vector<int> _PC, _SP, _AC, _X, _Y, _mode, _time;
+    std::vector<unsigned> _rng;
+    std::vector<std::string> _output;
+
+    // The lanes parked at each address.
+    std::vector<std::vector<int> > _parked;
+    unsigned long long _waiting[WAIT_WORDS];
+
+    Group _group;
+
+    // The image that every lane starts from, each lane's page table, and
+    // how many lanes have their own copy of each page.
+    std::vector<int> _image;
+    std::vector<int *> _pages;
+    std::vector<unsigned char> _owned;
+    std::vector<int> _private;
+
+    /**
+     * Stop a lane after it breaks a memory protection rule, recording the
+     * same message that the CPU would have printed.
+     * @arg lane: The lane to stop.
+     * @arg msg: The message to record.
+     */
+    void _fault(int lane, const std::string &msg);
+
+    /**
+     * Read a lane's memory, checking the same rules as the CPU.
+     * @arg lane: The lane making the read.
+     * @arg mode: The lane's execution mode.
+     * @arg addr: The address to read.
+     * @arg val: Set to the value at that address.
+     * @return: False if the read faulted and the lane has stopped.
+     */
+    bool _load(int lane, int mode, int addr, int &val);
+
+    /**
+     * Write to a lane's memory, copying the page first if it is shared.
+     * @arg lane: The lane making the write.
+     * @arg mode: The lane's execution mode.
+     * @arg addr: The address to write.
+     * @arg val: The value to store.
+     * @return: False if the write faulted and the lane has stopped.
+     */
+    bool _store(int lane, int mode, int addr, int val);
+
+    // Whether every lane in the group reads the same value at an address.
+    bool _shared(int addr) const;
+
+    // Park a lane at its PC, or stop it if the CPU could not fetch from there.
+    void _park(int lane);
+
+    // Gather every lane parked at an address into the group.
+    void _gather(int pc);
+
+    /**
+     * Park every lane in the group again.
+     * @arg next: The PC that every lane goes on to, unless the group branched.
+     */
+    void _scatter(int next);
+
+    // Park one lane of the group on its own, such as one whose code differs.
+    void _release(int k);
+
+    // Drop every lane that has stopped or left the group.
+    void _compact();
+
+    // The fewest instructions that the group can run before a lane's timer expires.
+    int _deadline() const;
+
+    /**
+     * Bring every lane's time up to date and interrupt any whose timer has expired.
+     * @arg next: The PC that every lane goes on to, unless the group branched.
+     */
+    void _tick(int next);
+
+    // The same as _load and _store for a lane in the group, removing it from
+    // the group if it faults.
+    bool _read(int k, int addr, int &val);
+    bool _write(int k, int addr, int val);
+    bool _push(int k, int val);
+    bool _pop(int k, int &val);
+
+    /**
+     * Enter kernel mode for a lane in the group and jump to a handler, as the CPU does.
+     * @arg k: The lane's slot in the group.
+     * @arg vector: The address of the handler (1000 or 1500).
+     */
+    void _interrupt(int k, int vector);
+
+    /**
+     * Fetch the instruction at the group's PC, removing any lanes that may
+     * not run it.
+     * @arg pc: The address every lane in the group is at.
+     * @return: The instruction that the remaining lanes agree on.
+     */
+    int _fetch(int pc);
+
+    /**
+     * Fetch the operand that follows an instruction.
+     * @arg pc: The address of the instruction.
+     * @arg op: Set to the operand if every lane reads the same one.
+     * @return: Whether op was set; otherwise each lane's operand is in the group.
+     */
+    bool _operand(int pc, int &op);
+
+    /**
+     * Run an instruction for every lane in the group.
+     * @arg pc: The address every lane in the group is at.
+     * @arg instr: The instruction at that address.
+     * @return: The PC that every lane goes on to, unless the group branched.
+     */
+    int _execute(int pc, int instr);
+
+public:
+    /**
+     * Prepares every lane to start the program from address 0 in user mode.
+     * @arg image: The loaded program image.
+     * @arg size: The number of words in the image.
+     * @arg lanes: The number of copies to run.
+     * @arg timer: The number of instructions that can pass before a timer interrupt occurs.
+     * @arg seed: The random seed of lane 0; every further lane adds one.
+     */
+    BatchEngine(const int *image, int size, int lanes, int timer, unsigned seed);
+    ~BatchEngine();
+
+    /**
+     * Runs every lane until it reaches End or faults.
+     * @return: The total number of instructions executed across all lanes.
+     */
+    long run();
+
+    // The number of instructions run by groups, however many lanes each held.
+    long groups() const { return _groups; }
+
+    // The number of times that parked lanes were gathered into a group.
+    long gathers() const { return _gathers; }
+
+    // Everything a lane printed.
+    const std::string &output(int lane) const { return _output[lane]; }
+
+    // The name of the vector instructions used for register arithmetic.
+    static const char *simd();
+};
+
+#endif /* batch_hpp */
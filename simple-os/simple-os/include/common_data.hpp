@@ -18,6 +18,10 @@ enum INSTR {Load_Val=1, Load_Addr=2, LoadInd_Addr=3, LoadIdxX_Addr=4, LoadIdxY_A
     Jump_Addr=20, JumpIfEqual_Addr=21, JumpIfNotEqual_Addr=22, Call_Addr=23, Ret=24,
     IncX=25, DecX=26, Push=27, Pop=28, Int=29, IRet=30, End=50};
 
+// Each user program is loaded into its own partition of this many words:
+// 0-999 for the user program, 1000-1999 for system code.
+const int PARTITION_SIZE = 2000;
+
 // A sequence of flags that can be sent to memory to command termination.
 enum CMD { READ=0, WRITE=1, TERMINATE=2};
 
@@ -14,12 +14,23 @@
 #define cpu_hpp
 
 #include <stdio.h>
+#include <map>
+#include <vector>
+
+#include "aot.hpp"
 #include "common_data.hpp"
+#include "handlers.hpp"
+#include "prefetch.hpp"
+#include "scheduler.hpp"
+#include "timing.hpp"
 
 enum EXECUTION_MODE {KERNEL, USER};
 
 class CPU
 {
+    // Native handlers need to reach the registers and memory directly.
+    friend class NativeHandler;
+    
 private:
     // These represent the registers that the CPU will use.
     int _PC,     // Program Counter (Starts at Beginning of User Memory)
@@ -29,6 +40,12 @@ private:
         _X,
         _Y;
     
+    // Relocation registers for the partition that the running program
+    // was loaded into. Every address is checked against the limit and
+    // offset by the base before it is sent to memory.
+    int _base,
+        _limit;
+    
     bool _mode;
     int _timer_val, // The number of instructions that pass without timeout
         _time;      // The current number of instructions that have passed
@@ -37,9 +54,88 @@ private:
     int _in,     // memory to cpu
         _out;    // cpu to memory
     
+    // Optional cycle-level timing model (NULL when timing is disabled).
+    TimingModel *_timing;
+    
+    // A native handler along with the code words it was registered or matched with.
+    struct HandlerPattern
+    {
+        std::vector<int> code;
+        NativeHandler *handler;
+    };
+    
+    // Native handlers registered for a vector, registered by code pattern,
+    // and the results of matching the code found at each vector so far.
+    std::map<int, NativeHandler *> _vector_handlers;
+    std::vector<HandlerPattern> _patterns;
+    std::map<int, HandlerPattern> _matched;
+    size_t _longest_pattern;
+    
+    // When set, handlers are always interpreted even if a native one exists.
+    bool _force_interpret;
+    
+    // Process table used when several programs share the CPU (NULL otherwise).
+    Scheduler *_scheduler;
+    
+    /**
+     * Copy the registers into a process table entry.
+     * @arg p: The entry to save into.
+     */
+    void _save(Process &p);
+    
+    /**
+     * Load the registers from a process table entry.
+     * @arg p: The entry to restore from.
+     */
+    void _restore(const Process &p);
+    
+    /**
+     * Save the running process and switch to the one the scheduler picks.
+     * @arg finished: Whether the running process has executed End.
+     * @return: False if every process has ended and there is nothing to run.
+     */
+    bool _context_switch(bool finished);
+    
+    // Compiled blocks for the program, and the memory they share with the
+    // CPU in place of the pipes (both NULL when interpreting).
+    AotProgram *_aot;
+    int *_local_mem;
+    
+    // Fetch, process and count a single instruction, then check the timer.
+    void _step();
+    
+    // Raise a timer interrupt (or switch processes) if the timer has expired.
+    void _check_timer();
+    
+    /**
+     * Run the compiled block containing the PC, if there is one.
+     * @return: False if the next instruction must be interpreted instead.
+     */
+    bool _run_compiled();
+    
+    // Optional stride prefetcher for reads (NULL when prefetching is disabled),
+    // and the address of the instruction being executed, which it learns from.
+    Prefetcher *_prefetch;
+    int _instr_addr;
+    
     // Processes the instruction currently stored in the IR.
     void _process();
     
+    /**
+     * Enter kernel mode, save the user SP and PC on the system stack and jump
+     * to a handler. If a native handler exists for it, it is run immediately.
+     * @arg vector: The address of the handler (1000 for the timer, 1500 for Int).
+     */
+    void _interrupt(int vector);
+    
+    /**
+     * Look up the native handler for a vector, matching the code there against
+     * the registered patterns the first time it is entered.
+     * @arg frame: The interrupt being handled; its code is filled in on a match.
+     * @return: The handler to run, or NULL if the handler must be interpreted.
+     */
+    NativeHandler *_find_handler(InterruptFrame &frame);
+    
     /**
      * Fetch the next value from memory.
      * @return: The next load value.
@@ -53,6 +149,24 @@ private:
      */
     int _read_address(int addr);
     
+    /**
+     * Request the value at an address from memory, without any protection
+     * checks or timing.
+     * @arg addr: The numerical address to check (0-1999).
+     * @return: The value in memory at that address.
+     */
+    int _memory_read(int addr);
+    
+    /**
+     * Check an address against the limit register and offset it by the base.
+     * @arg addr: The address as seen by the running program.
+     * @return: The physical address in memory.
+     */
+    int _relocate(int addr);
+    
+    // Tell memory to shut down.
+    void _terminate();
+    
     /**
      * Save the given value into this address.
      * @arg addr: The address to save to.
@@ -78,11 +192,38 @@ public:
      * @arg input_pipe: The mem_to_cpu read end of a pipe [0]
      * @arg output_pipe: The cpu_to_mem write end of a pipe [1]
      * @arg timer: The number of instructions that can pass before a timer interrupt occurs.
+     * @arg timing: An optional timing model to charge cycles to as instructions execute.
+     * @arg scheduler: An optional process table to run several programs from, in which
+     *                 case the timer switches between them instead of interrupting.
+     * @arg aot: An optional compiled program to run, in which case memory is accessed
+     *           directly through it instead of through the pipes.
+     * @arg prefetch: An optional prefetcher to send speculative reads to memory through.
      */
-    CPU(int input_pipe, int output_pipe, int timer);
+    CPU(int input_pipe, int output_pipe, int timer, TimingModel *timing = NULL, Scheduler *scheduler = NULL,
+        AotProgram *aot = NULL, Prefetcher *prefetch = NULL);
     
     // Perform the instruction currently located on the Program Counter.
     void execute();
+    
+    /**
+     * Run a native handler whenever the given vector is entered.
+     * @arg vector: The handler address, such as 1000 or 1500.
+     * @arg handler: The native implementation to run in its place.
+     */
+    void register_handler(int vector, NativeHandler *handler);
+    
+    /**
+     * Run a native handler whenever the code at a vector matches a pattern.
+     * @arg pattern: The code words to match; ANY_WORD matches any value.
+     * @arg handler: The native implementation to run in its place.
+     */
+    void register_handler(const std::vector<int> &pattern, NativeHandler *handler);
+    
+    /**
+     * Choose whether to ignore native handlers and always interpret.
+     * @arg force: True to always use the interpreted handlers.
+     */
+    void force_interpreter(bool force);
 };
 
 #endif /* cpu_hpp */
@@ -0,0 +1,100 @@
+//
+//  handlers.hpp
+//
+// Provides the base class for native (C++) implementations of the guest's
+// interrupt handlers. When the CPU enters the kernel for a timer interrupt
+// or a system call, it may run one of these instead of interpreting the
+// handler at address 1000 or 1500 one instruction at a time. A handler is
+// either registered for a specific vector, or recognized by matching the
+// code bytes found at the vector against a pattern.
+//
+
+#ifndef handlers_hpp
+#define handlers_hpp
+
+#include <vector>
+
+class CPU;
+
+// A pattern word that matches any value, such as the operand of a Load.
+const int ANY_WORD = -1;
+
+// The state available to a native handler when it is invoked.
+struct InterruptFrame
+{
+    int vector,     // The handler address that the CPU jumped to (1000 or 1500)
+        saved_pc,   // The user PC that was pushed onto the system stack
+        saved_sp;   // The user SP that was pushed onto the system stack
+
+    // The code words that were matched at the vector, or NULL when the
+    // handler was registered by vector instead of by pattern.
+    const std::vector<int> *code;
+};
+
+class NativeHandler
+{
+protected:
+    // Handlers are not members of the CPU, so they reach its registers and
+    // memory through these accessors. Memory accesses go through the same
+    // protection checks and timing model as interpreted instructions.
+    static int &PC(CPU &cpu);
+    static int &SP(CPU &cpu);
+    static int &AC(CPU &cpu);
+    static int &X(CPU &cpu);
+    static int &Y(CPU &cpu);
+    static bool &mode(CPU &cpu);
+    static int read(CPU &cpu, int addr);
+    static void write(CPU &cpu, int addr, int val);
+    static void push(CPU &cpu, int val);
+
+    /**
+     * Restores the user PC and SP that the interrupt saved and returns to
+     * user mode, just as IRet does, without reading them back from memory.
+     * @arg frame: The frame describing the interrupt being returned from.
+     */
+    static void iret(CPU &cpu, const InterruptFrame &frame);
+
+public:
+    virtual ~NativeHandler() {}
+
+    /**
+     * Performs the same guest-visible effects as the interpreted handler.
+     * The CPU has already pushed the user SP and PC and switched to the
+     * system stack when this is called.
+     * @arg cpu: The CPU whose registers and memory should be updated.
+     * @arg frame: Details about the interrupt being handled.
+     * @return: The number of guest instructions that this stands in for.
+     */
+    virtual int run(CPU &cpu, const InterruptFrame &frame) = 0;
+};
+
+// A handler that consists of nothing but IRet.
+class ReturnHandler : public NativeHandler
+{
+public:
+    int run(CPU &cpu, const InterruptFrame &frame);
+};
+
+// Saves AC, X and Y, increments the word at one address into another
+// (Load a, CopyToX, IncX, CopyFromX, Store b), then restores and returns.
+class CounterHandler : public NativeHandler
+{
+public:
+    int run(CPU &cpu, const InterruptFrame &frame);
+};
+
+// Saves AC, X and Y, prints the word at an address followed by a newline
+// (Load a, Put 1, Load 10, Put 2), then restores and returns.
+class PrintHandler : public NativeHandler
+{
+public:
+    int run(CPU &cpu, const InterruptFrame &frame);
+};
+
+/**
+ * Registers each of the handlers above with the CPU by their code patterns.
+ * @arg cpu: The CPU that should recognize the built-in handlers.
+ */
+void RegisterBuiltinHandlers(CPU &cpu);
+
+#endif /* handlers_hpp */
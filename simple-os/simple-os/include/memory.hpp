@@ -13,18 +13,20 @@
 
 #include <cstdio>
 #include <string>
+#include <vector>
 
 #include "common_data.hpp"
 
 class Memory
 {
 private:
-    // Memory will consist of 2000 integer entries:
+    // Memory will consist of 2000 integer entries for each program:
     // 0-999 for the user program,
     // 1000-1999 for system code.
-    const static int MEM_SIZE = 2000;
+    // Additional programs are placed in consecutive partitions after the first.
+    const static int MEM_SIZE = PARTITION_SIZE;
     const static int BUF_SIZE = 1024;
-    int main_mem[MEM_SIZE];
+    std::vector<int> main_mem;
     
     // Ends of UNIX-style pipes for communication
     int in,     // cpu to memory
@@ -34,22 +36,33 @@ private:
      * Read the sequence of user instructions into memory so that the CPU can begin executing them.
      * Note that this is automatically called by the constructor upon initialization.
      * @arg program_file_path: The path to the file containing instructions from the user.
+     * @arg base: The address of the partition to load the program into.
      */
-    void ReadUserProgram(std::string program_file_path);
+    void ReadUserProgram(std::string program_file_path, int base);
     
 public:
     /**
      * The main memory class will be initialized to contain all 0's upon creation.
      * @arg input_pipe: The cpu_to_mem read end of a pipe [0]
      * @arg output_pipe: The mem_to_cpu write end of a pipe [1]
-     * @arg program_file_path: The file path to the user's program containing instructions for the CPU.
+     * @arg program_file_paths: The file paths to the user programs containing instructions for the CPU,
+     *                           each of which is loaded into its own partition.
      */
-    Memory(int input_pipe, int output_pipe, std::string program_file_path);
+    Memory(int input_pipe, int output_pipe, const std::vector<std::string> &program_file_paths);
     
     /**
      * Cycle will simply wait until the next instruction is sent by the CPU for either a read or a write.
      */
     void Cycle();
+    
+    /**
+     * Gives direct access to the loaded memory, for running a compiled program in the same process.
+     * @return: The first word of memory.
+     */
+    int *Data() { return &main_mem[0]; }
+    
+    // The total number of words in memory.
+    int Size() const { return main_mem.size(); }
 };
 
 #endif /* memory_hpp */
@@ -0,0 +1,126 @@
+//
+//  prefetch.hpp
+//
+// Contains the optional stride prefetcher for the CPU-to-memory channel.
+// A small reference prediction table, indexed by the address of the
+// instruction making the read, learns sequential and constant-stride
+// address streams. Once a stream is confirmed, read requests for the next
+// addresses are sent to memory ahead of time and their replies are
+// collected later, so the round trip overlaps with execution instead of
+// blocking it. Instruction and operand fetches are treated as a single
+// sequential stream.
+//
+
+#ifndef prefetch_hpp
+#define prefetch_hpp
+
+#include <cstdio>
+#include <deque>
+
+class Prefetcher
+{
+private:
+    const static int TABLE_SIZE = 64;
+    const static int BUFFER_SIZE = 16;
+
+    // One stream in the reference prediction table.
+    struct Stream
+    {
+        int tag,        // The instruction address that owns this entry
+            last,       // The last address read by that instruction
+            stride,     // The distance between its last two reads
+            confidence; // How many times in a row the stride repeated
+    };
+
+    // A request that has been sent to memory but not yet read back. Writes
+    // to the same address after the request mark it stale.
+    struct Request
+    {
+        int addr;
+        bool stale;
+    };
+
+    // A reply that has been read back but not yet used.
+    struct Entry
+    {
+        int addr,
+            val;
+        bool valid;
+    };
+
+    Stream _table[TABLE_SIZE];
+    std::deque<Request> _pending;
+    Entry _buffer[BUFFER_SIZE];
+    int _next_slot;     // The buffer slot to replace next (oldest first)
+    int _max_outstanding;
+
+    // Handles for each communication pipe, shared with the CPU.
+    int _in,     // memory to cpu
+        _out;    // cpu to memory
+
+    long _issued,       // Speculative requests sent to memory
+         _useful,       // Prefetched values later used by a demand read
+         _late,         // Useful prefetches whose reply had not yet been read
+         _discarded,    // Prefetched values dropped by writes or replacement
+         _demand;       // Reads made by the CPU while prefetching
+
+    /**
+     * Read back the reply to the oldest outstanding request.
+     * @return: The value that memory sent back.
+     */
+    int _receive();
+
+    /**
+     * Keep a reply in the buffer until a demand read asks for it.
+     * @arg addr: The address the value was read from.
+     * @arg val: The value in memory at that address.
+     */
+    void _keep(int addr, int val);
+
+    // Whether an address is already buffered or on its way.
+    bool _tracked(int addr) const;
+
+public:
+    /**
+     * Creates a prefetcher with an empty table and buffer.
+     * @arg input_pipe: The mem_to_cpu read end of a pipe [0]
+     * @arg output_pipe: The cpu_to_mem write end of a pipe [1]
+     * @arg max_outstanding: The most requests that may be in flight at once.
+     */
+    Prefetcher(int input_pipe, int output_pipe, int max_outstanding);
+
+    /**
+     * Satisfy a demand read from a prefetched value if possible. Otherwise,
+     * every outstanding reply is collected so that the caller can make its
+     * own request and read the reply straight back.
+     * @arg addr: The physical address to read.
+     * @arg val: Set to the value at that address on success.
+     * @return: Whether the read was satisfied by a prefetch.
+     */
+    bool lookup(int addr, int &val);
+
+    /**
+     * Learn from a demand read and send requests along its stream.
+     * @arg instr_addr: The address of the instruction making the read.
+     * @arg addr: The address that was read, as seen by the program.
+     * @arg fetch: Whether this read was made at the program counter.
+     * @arg lo: The lowest address that may be prefetched.
+     * @arg hi: One past the highest address that may be prefetched.
+     * @arg base: The offset from program addresses to physical addresses.
+     */
+    void train(int instr_addr, int addr, bool fetch, int lo, int hi, int base);
+
+    /**
+     * Drop any prefetched copy of an address that is about to be written.
+     * @arg addr: The physical address being written.
+     */
+    void invalidate(int addr);
+
+    /**
+     * Prints the accuracy and coverage of the prefetches.
+     * @arg out: The stream to print the report to.
+     */
+    void report(FILE *out) const;
+};
+
+#endif /* prefetch_hpp */
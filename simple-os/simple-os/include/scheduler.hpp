@@ -0,0 +1,100 @@
+//
+//  scheduler.hpp
+//
+// Contains the host-side process table used when several user programs
+// share the CPU. Each program is loaded into its own partition of memory,
+// described by a base and limit, and the CPU saves and restores registers
+// through this table on every context switch instead of pushing them onto
+// a guest stack. The Scheduler also decides which process runs next and
+// keeps the per-process counters that are reported once all have ended.
+//
+
+#ifndef scheduler_hpp
+#define scheduler_hpp
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <time.h>
+
+// The policies that can be used to choose the next process to run.
+enum SCHED_POLICY {ROUND_ROBIN, SHORTEST_REMAINING};
+
+// A single entry in the process table.
+struct Process
+{
+    std::string name;
+
+    // Saved copies of the CPU registers while the process is not running.
+    int PC, SP, IR, AC, X, Y;
+    bool mode;
+
+    // The partition of physical memory that the process was loaded into.
+    int base,
+        limit;
+
+    // Counters reported when the process ends. Times are measured in
+    // instructions executed by any process since the run began.
+    long instructions,  // Instructions executed by this process
+         syscalls,      // Number of Int instructions that entered the kernel
+         preemptions,   // Number of times the timer switched it out
+         dispatches,    // Number of times it was switched in
+         first_run,     // Time it was first dispatched (-1 if never)
+         finish;        // Time it executed End (-1 while running)
+    bool done;
+};
+
+class Scheduler
+{
+private:
+    std::vector<Process> _table;
+    int _current;
+    SCHED_POLICY _policy;
+    long _clock,        // Instructions executed by every process so far
+         _switches;     // Number of switches between two different processes
+    timespec _start;    // Host time when the run began
+
+public:
+    /**
+     * Creates an empty process table.
+     * @arg policy: How to choose the next process on a timer expiry or exit.
+     */
+    Scheduler(SCHED_POLICY policy);
+
+    /**
+     * Adds a program to the table, ready to start from address 0 in user mode.
+     * @arg name: The program file, used when reporting.
+     * @arg base: The physical address where its partition begins.
+     * @arg limit: The number of words in its partition.
+     */
+    void add(std::string name, int base, int limit);
+
+    // The process that currently owns the CPU.
+    Process &current() { return _table[_current]; }
+
+    /**
+     * Accounts for instructions executed by the current process.
+     * @arg count: The number of instructions, if more than one.
+     */
+    void tick(int count = 1)
+    {
+        _clock += count;
+        _table[_current].instructions += count;
+    }
+
+    /**
+     * Chooses the process that should run next. The caller must already
+     * have saved the registers of the current process into its entry.
+     * @arg finished: Whether the current process has executed End.
+     * @return: The process to run, or NULL once every process has ended.
+     */
+    Process *next(bool finished);
+
+    /**
+     * Prints the counters for each process along with aggregate throughput.
+     * @arg out: The stream to print the report to.
+     */
+    void report(FILE *out) const;
+};
+
+#endif /* scheduler_hpp */
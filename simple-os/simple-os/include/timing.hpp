@@ -0,0 +1,127 @@
+//
+//  timing.hpp
+//
+// Contains the optional cycle-level timing model for the CPU. Each
+// retired instruction is charged a base cost according to its opcode
+// class, and every address the CPU reads or writes is run through a
+// configurable L1/L2 cache hierarchy in front of main memory. Kernel
+// entry for timer interrupts and system calls carries its own cost. The
+// model only observes the access stream; it never changes the values that
+// the guest program sees.
+//
+
+#ifndef timing_hpp
+#define timing_hpp
+
+#include <cstdio>
+#include <vector>
+
+#include "common_data.hpp"
+
+// The classes that instructions are grouped into for cycle accounting.
+enum OP_CLASS {ALU_OP=0, MEM_OP=1, BRANCH_OP=2, STACK_OP=3, IO_OP=4, SYS_OP=5, NUM_OP_CLASSES=6};
+
+// Describes a single level of the cache hierarchy.
+struct CacheConfig
+{
+    int size,       // Capacity in words (0 disables the level entirely)
+        line_size,  // Words per cache line
+        ways,       // Associativity of each set
+        latency;    // Cycles needed to look up this level
+};
+
+// Describes the whole memory hierarchy along with per-class costs.
+struct TimingConfig
+{
+    CacheConfig l1, l2;
+    int mem_latency,                    // Cycles for a request that misses every cache level
+        interrupt_cost,                 // Cycles for a mode switch into the kernel
+        class_cycles[NUM_OP_CLASSES];   // Base cycles for each opcode class
+
+    // Builds a configuration with reasonable defaults for every field.
+    TimingConfig();
+};
+
+class Cache
+{
+private:
+    CacheConfig _config;
+    int _sets;
+
+    // Tags are stored set by set, with a -1 marking an empty way. The
+    // stamps record the last access to each way for LRU replacement.
+    std::vector<int> _tags;
+    std::vector<unsigned long> _stamps;
+    unsigned long _clock;
+
+public:
+    long hits,
+         misses;
+
+    /**
+     * Creates an empty cache with the given geometry.
+     * @arg config: The size, line size, associativity and latency of this level.
+     */
+    Cache(const CacheConfig &config);
+
+    /**
+     * Looks up an address, filling its line on a miss.
+     * @arg addr: The word address being accessed.
+     * @return: Whether the address was already present in the cache.
+     */
+    bool access(int addr);
+
+    // Whether this level takes part in the hierarchy at all.
+    bool enabled() const { return _sets > 0; }
+
+    int latency() const { return _config.latency; }
+};
+
+class TimingModel
+{
+private:
+    Cache _l1,
+          _l2;
+    TimingConfig _config;
+
+    long _cycles,        // Total simulated cycles so far
+         _instructions,  // Number of retired instructions
+         _interrupts;    // Number of kernel entries taken
+
+public:
+    /**
+     * Creates a timing model with cold caches.
+     * @arg config: The hierarchy and cost configuration to simulate.
+     */
+    TimingModel(const TimingConfig &config);
+
+    /**
+     * Charges the latency of a single memory access through the hierarchy.
+     * @arg addr: The address that the CPU read from or wrote to.
+     */
+    void access(int addr);
+
+    /**
+     * Charges the base cost of an instruction once it has been processed.
+     * @arg instr: The instruction that was just retired.
+     */
+    void retire(int instr);
+
+    // Charges the cost of switching into kernel mode for an interrupt.
+    void interrupt();
+
+    /**
+     * Prints the total cycles, CPI and per-level miss rates.
+     * @arg out: The stream to print the report to.
+     */
+    void report(FILE *out) const;
+
+    /**
+     * Maps an instruction to the class used for its base cost.
+     * @arg instr: The instruction to classify.
+     * @return: The opcode class that the instruction belongs to.
+     */
+    static OP_CLASS classify(int instr);
+};
+
+#endif /* timing_hpp */
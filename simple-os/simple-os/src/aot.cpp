@@ -0,0 +1,501 @@
+//
+//  aot.cpp
+//
+// This file contains the ahead-of-time translator. Blocks are found by
+// following control flow from the user program at 0 and the handlers at
+// 1000 and 1500. Every compiled instruction performs the same protection
+// checks as the interpreter; when one fails, or when a store would land on
+// translated code, the block saves the registers as they were before that
+// instruction and hands it back to the interpreter to perform (and report
+// or invalidate) exactly as it normally would. Each instruction counts
+// toward the timer, and a block returns as soon as the timer expires in
+// user mode so the CPU can raise the interrupt at the right instruction.
+//
+
+#include "aot.hpp"
+#include "common_data.hpp"
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <cstdlib>
+#include <set>
+
+// The number of operand words that follow each instruction.
+static int operandCount(int instr)
+{
+    switch(instr)
+    {
+        case Load_Val: case Load_Addr: case LoadInd_Addr: case LoadIdxX_Addr: case LoadIdxY_Addr:
+        case Store_Addr: case Put_Port: case Jump_Addr: case JumpIfEqual_Addr:
+        case JumpIfNotEqual_Addr: case Call_Addr:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Whether a word is one of the instructions that the CPU supports.
+static bool isInstruction(int instr)
+{
+    return (instr >= Load_Val && instr <= IRet) || instr == End;
+}
+
+/**
+ * Whether a path is safe to load code from or write code into: it must be
+ * owned by us, and nobody else may be able to write to it.
+ * @arg path: The file or directory to check.
+ * @arg directory: Whether the path should be a directory (or else a regular file).
+ * @return: Whether the path exists and passes every check.
+ */
+static bool isPrivate(const std::string &path, bool directory)
+{
+    struct stat info;
+    if(lstat(path.c_str(), &info) != 0)
+        return false;
+    if(directory ? !S_ISDIR(info.st_mode) : !S_ISREG(info.st_mode))
+        return false;
+    return info.st_uid == getuid() && (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/**
+ * Finds the directory that compiled images are cached in, creating it if
+ * needed: $SIMPLEOS_AOT_CACHE, or else simpleos-aot under $XDG_CACHE_HOME
+ * or ~/.cache.
+ * @arg cache: Set to the path of the directory.
+ * @return: False if there is nowhere private to keep the cache.
+ */
+static bool cacheDirectory(std::string &cache)
+{
+    const char *dir = getenv("SIMPLEOS_AOT_CACHE");
+    if(dir && *dir)
+        cache = dir;
+    else
+    {
+        const char *xdg = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        std::string parent;
+        if(xdg && *xdg)
+            parent = xdg;
+        else if(home && *home)
+            parent = std::string(home) + "/.cache";
+        else
+            return false;
+        if(mkdir(parent.c_str(), 0700) != 0 && errno != EEXIST)
+            return false;
+        cache = parent + "/simpleos-aot";
+    }
+    if(mkdir(cache.c_str(), 0700) != 0 && errno != EEXIST)
+        return false;
+    return isPrivate(cache, true);
+}
+
+/**
+ * Compiles generated source into a shared object, running the compiler
+ * directly rather than through the shell.
+ * @arg source: The path of the generated source.
+ * @arg library: The path to write the shared object to.
+ * @return: Whether the compiler ran and succeeded.
+ */
+static bool compileLibrary(const std::string &source, const std::string &library)
+{
+    const char *cxx = getenv("CXX");
+    if(!cxx || !*cxx)
+        cxx = "c++";
+    const char *args[] = {cxx, "-O2", "-w", "-shared", "-fPIC", "-o", library.c_str(), source.c_str(), NULL};
+
+    fflush(stdout);
+    pid_t child = fork();
+    if(child < 0)
+        return false;
+    if(child == 0)
+    {
+        execvp(cxx, (char *const *)args);
+        _exit(127);
+    }
+
+    int status;
+    while(waitpid(child, &status, 0) < 0)
+    {
+        if(errno != EINTR)
+            return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+AotProgram::AotProgram(int *mem, int size)
+{
+    _mem = mem;
+    _size = size;
+    _library = NULL;
+    _entry.assign(size, -1);
+    _code.assign(size, 0);
+    compiled_instructions = 0;
+    interpreted_instructions = 0;
+    invalidations = 0;
+}
+
+AotProgram::~AotProgram()
+{
+    if(_library)
+        dlclose(_library);
+}
+
+void AotProgram::_analyze()
+{
+    // First, follow every path of execution to find where blocks begin.
+    std::set<int> leaders;
+    std::vector<int> worklist;
+    std::vector<bool> decoded(_size, false);
+    const int entries[] = {0, 1000, 1500};
+    for(int i = 0; i < 3; i++)
+    {
+        if(entries[i] < _size)
+        {
+            leaders.insert(entries[i]);
+            worklist.push_back(entries[i]);
+        }
+    }
+
+    while(!worklist.empty())
+    {
+        int pc = worklist.back();
+        worklist.pop_back();
+
+        bool stop = false;
+        while(!stop && pc < _size && !decoded[pc])
+        {
+            decoded[pc] = true;
+            int instr = _mem[pc];
+            int next = pc + 1 + operandCount(instr);
+            if(next > _size || !isInstruction(instr))
+                break;
+
+            // Every reachable instruction is guarded, including the Int, IRet
+            // and End words that no block covers, so that compiled stores
+            // over any of them are left to the interpreter.
+            for(int addr = pc; addr < next; addr++)
+                _code[addr] = 1;
+            int op = (next > pc + 1) ? _mem[pc + 1] : 0;
+
+            // Collect any addresses that execution may continue from.
+            std::vector<int> targets;
+            switch(instr)
+            {
+                case Jump_Addr:
+                    targets.push_back(op);
+                    stop = true;
+                    break;
+                case JumpIfEqual_Addr: case JumpIfNotEqual_Addr: case Call_Addr:
+                    targets.push_back(op);
+                    targets.push_back(next);
+                    stop = true;
+                    break;
+                case Int:
+                    targets.push_back(next);
+                    stop = true;
+                    break;
+                case Ret: case IRet: case End:
+                    stop = true;
+                    break;
+            }
+            for(size_t i = 0; i < targets.size(); i++)
+            {
+                if(targets[i] >= 0 && targets[i] < _size && leaders.insert(targets[i]).second)
+                    worklist.push_back(targets[i]);
+            }
+            pc = next;
+        }
+    }
+
+    // Then split the code into blocks, each running until a branch, an
+    // instruction that must be interpreted, or the start of another block.
+    // Words that are not valid instructions (such as empty memory) are left
+    // to the interpreter, which skips over them.
+    for(std::set<int>::iterator it = leaders.begin(); it != leaders.end(); it++)
+    {
+        Block block;
+        block.start = *it;
+        block.fn = NULL;
+        block.valid = false;
+
+        int pc = block.start;
+        while(pc < _size)
+        {
+            int instr = _mem[pc];
+            int next = pc + 1 + operandCount(instr);
+            if(instr == Int || instr == IRet || instr == End || next > _size || !isInstruction(instr))
+                break;
+            block.instructions.push_back(pc);
+            pc = next;
+            if(instr == Jump_Addr || instr == JumpIfEqual_Addr || instr == JumpIfNotEqual_Addr ||
+               instr == Call_Addr || instr == Ret || leaders.count(pc))
+                break;
+        }
+        block.end = pc;
+        if(block.instructions.empty())
+            continue;
+
+        for(size_t i = 0; i < block.instructions.size(); i++)
+        {
+            if(_entry[block.instructions[i]] < 0)
+                _entry[block.instructions[i]] = _blocks.size();
+        }
+        for(int addr = block.start; addr < block.end; addr++)
+            _code[addr] = 1;
+        _blocks.push_back(block);
+    }
+}
+
+std::string AotProgram::_image_hash() const
+{
+    // 64-bit FNV-1a over the ABI version and every word of the image.
+    unsigned long long hash = 14695981039346656037ULL;
+    std::vector<int> words(1, AOT_ABI_VERSION);
+    words.insert(words.end(), _mem, _mem + _size);
+    const unsigned char *bytes = (const unsigned char *)&words[0];
+    for(size_t i = 0; i < words.size() * sizeof(int); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", hash);
+    return buffer;
+}
+
+void AotProgram::_emit(FILE *out) const
+{
+    fprintf(out, "// Generated by simpleos from a program image. Do not edit.\n");
+    fprintf(out, "#include <cstdio>\n#include <cstdlib>\n\n");
+    fprintf(out, "struct AotState\n{\n    int PC, SP, AC, X, Y, mode, time, timer;\n"
+                 "    int *mem;\n    const unsigned char *code;\n};\n\n");
+    fprintf(out, "static const int SIZE = %d;\n\n", _size);
+
+    // Registers only live in the state while the block is not running.
+    fprintf(out, "#define SAVE(pc) (s->PC = (pc), s->SP = SP, s->AC = AC, s->X = X, s->Y = Y, s->time = time)\n");
+    fprintf(out, "#define DONE(pc) do { SAVE(pc); return %d; } while(0)\n", AOT_CONTINUE);
+    fprintf(out, "#define BAIL(pc) do { SAVE(pc); return %d; } while(0)\n", AOT_INTERPRET);
+    fprintf(out, "#define BAD(a) ((a) < 0 || (a) >= SIZE || (user && (a) >= 1000))\n");
+    fprintf(out, "#define TICK(next) do { time++; if(user && time >= timer) DONE(next); } while(0)\n\n");
+
+    for(size_t b = 0; b < _blocks.size(); b++)
+    {
+        const Block &block = _blocks[b];
+        fprintf(out, "extern \"C\" int block_%d(AotState *s)\n{\n", block.start);
+        fprintf(out, "    int SP = s->SP, AC = s->AC, X = s->X, Y = s->Y, time = s->time;\n");
+        fprintf(out, "    const int user = s->mode, timer = s->timer;\n");
+        fprintf(out, "    int *mem = s->mem;\n    const unsigned char *code = s->code;\n");
+
+        // Execution may resume at any instruction, such as after an interrupt.
+        fprintf(out, "    switch(s->PC)\n    {\n");
+        for(size_t i = 0; i < block.instructions.size(); i++)
+            fprintf(out, "        case %d: goto i%d;\n", block.instructions[i], block.instructions[i]);
+        fprintf(out, "        default: return %d;\n    }\n", AOT_INTERPRET);
+
+        for(size_t i = 0; i < block.instructions.size(); i++)
+            _emit_instruction(out, block.instructions[i], i + 1 == block.instructions.size());
+        fprintf(out, "}\n\n");
+    }
+
+    // The table of blocks, in the same order that _analyze() produces them.
+    fprintf(out, "typedef int (*AotBlockFn)(AotState *);\n");
+    fprintf(out, "extern \"C\" const int simpleos_abi_version = %d;\n", AOT_ABI_VERSION);
+    fprintf(out, "extern \"C\" const int simpleos_block_count = %zu;\n", _blocks.size());
+    fprintf(out, "extern \"C\" const AotBlockFn simpleos_blocks[] = {\n");
+    for(size_t b = 0; b < _blocks.size(); b++)
+        fprintf(out, "    block_%d,\n", _blocks[b].start);
+    fprintf(out, "};\n");
+}
+
+void AotProgram::_emit_instruction(FILE *out, int pc, bool last) const
+{
+    int instr = _mem[pc];
+    int next = pc + 1 + operandCount(instr);
+    int op = (next > pc + 1) ? _mem[pc + 1] : 0;
+
+    fprintf(out, "i%d:\n", pc);
+    switch(instr)
+    {
+        case Load_Val:
+            fprintf(out, "    AC = %d;\n", op);
+            break;
+        case Load_Addr:
+            fprintf(out, "    if(BAD(%d)) BAIL(%d);\n    AC = mem[%d];\n", op, pc, op);
+            break;
+        case LoadInd_Addr:
+            fprintf(out, "    if(BAD(%d)) BAIL(%d);\n", op, pc);
+            fprintf(out, "    { int a = mem[%d]; if(BAD(a)) BAIL(%d); AC = mem[a]; }\n", op, pc);
+            break;
+        case LoadIdxX_Addr:
+            fprintf(out, "    { int a = %d + X; if(BAD(a)) BAIL(%d); AC = mem[a]; }\n", op, pc);
+            break;
+        case LoadIdxY_Addr:
+            fprintf(out, "    { int a = %d + Y; if(BAD(a)) BAIL(%d); AC = mem[a]; }\n", op, pc);
+            break;
+        case LoadSpX:
+            fprintf(out, "    { int a = SP + X; if(BAD(a)) BAIL(%d); AC = mem[a]; }\n", pc);
+            break;
+        case Store_Addr:
+            fprintf(out, "    if(BAD(%d) || code[%d]) BAIL(%d);\n    mem[%d] = AC;\n", op, op, pc, op);
+            break;
+        case Get:
+            fprintf(out, "    AC = (rand() %% 100) + 1;\n");
+            break;
+        case Put_Port:
+            if(op == 1)
+                fprintf(out, "    printf(\"%%d\", AC);\n");
+            else if(op == 2)
+                fprintf(out, "    printf(\"%%c\", AC);\n");
+            break;
+        case AddX:     fprintf(out, "    AC += X;\n"); break;
+        case AddY:     fprintf(out, "    AC += Y;\n"); break;
+        case SubX:     fprintf(out, "    AC -= X;\n"); break;
+        case SubY:     fprintf(out, "    AC -= Y;\n"); break;
+        case CopyToX:  fprintf(out, "    X = AC;\n"); break;
+        case CopyFromX: fprintf(out, "    AC = X;\n"); break;
+        case CopyToY:  fprintf(out, "    Y = AC;\n"); break;
+        case CopyFromY: fprintf(out, "    AC = Y;\n"); break;
+        case CopyToSp: fprintf(out, "    SP = AC;\n"); break;
+        case CopyFromSp: fprintf(out, "    AC = SP;\n"); break;
+        case IncX:     fprintf(out, "    X++;\n"); break;
+        case DecX:     fprintf(out, "    X--;\n"); break;
+        case Push:
+            fprintf(out, "    { int a = SP - 1; if(BAD(a) || code[a]) BAIL(%d); mem[a] = AC; SP = a; }\n", pc);
+            break;
+        case Pop:
+            fprintf(out, "    if(BAD(SP)) BAIL(%d);\n    AC = mem[SP];\n    SP++;\n", pc);
+            break;
+
+        // Branches always end the block, so the CPU can look up the next one.
+        case Jump_Addr:
+            fprintf(out, "    time++;\n    DONE(%d);\n", op);
+            return;
+        case JumpIfEqual_Addr:
+            fprintf(out, "    time++;\n    DONE(AC == 0 ? %d : %d);\n", op, next);
+            return;
+        case JumpIfNotEqual_Addr:
+            fprintf(out, "    time++;\n    DONE(AC != 0 ? %d : %d);\n", op, next);
+            return;
+        case Call_Addr:
+            fprintf(out, "    { int a = SP - 1; if(BAD(a) || code[a]) BAIL(%d); mem[a] = %d; SP = a; }\n", pc, next);
+            fprintf(out, "    time++;\n    DONE(%d);\n", op);
+            return;
+        case Ret:
+            fprintf(out, "    { if(BAD(SP)) BAIL(%d); int a = mem[SP]; SP++; time++; DONE(a); }\n", pc);
+            return;
+
+        default:
+            break;
+    }
+
+    if(last)
+        fprintf(out, "    time++;\n    DONE(%d);\n", next);
+    else
+        fprintf(out, "    TICK(%d);\n", next);
+}
+
+bool AotProgram::load()
+{
+    _analyze();
+    if(_blocks.empty())
+        return true;
+
+    // Compiled images are kept between runs, named by the hash of the image.
+    // The cache may only be used if nobody else can put code in it.
+    std::string cache;
+    if(!cacheDirectory(cache))
+    {
+        fprintf(stderr, "AOT: No private cache directory is available; interpreting instead.\n");
+        _code.assign(_size, 0);
+        return false;
+    }
+    std::string base = cache + "/" + _image_hash();
+    std::string library = base + ".so";
+
+    if(access(library.c_str(), R_OK) != 0)
+    {
+        std::string source = base + ".cpp";
+        FILE *out = fopen(source.c_str(), "w");
+        if(!out)
+        {
+            fprintf(stderr, "AOT: Could not write %s; interpreting instead.\n", source.c_str());
+            _code.assign(_size, 0);
+            return false;
+        }
+        _emit(out);
+        fclose(out);
+
+        // Build to a temporary name first so that a concurrent run never
+        // loads a half-written library.
+        char temp[32];
+        snprintf(temp, sizeof(temp), ".%d.tmp", (int)getpid());
+        if(!compileLibrary(source, library + temp) || rename((library + temp).c_str(), library.c_str()) != 0)
+        {
+            fprintf(stderr, "AOT: Could not compile %s; interpreting instead.\n", source.c_str());
+            _code.assign(_size, 0);
+            return false;
+        }
+    }
+
+    if(!isPrivate(library, false))
+    {
+        fprintf(stderr, "AOT: %s could have been written by another user; interpreting instead.\n",
+                library.c_str());
+        _code.assign(_size, 0);
+        return false;
+    }
+
+    _library = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    const int *version = _library ? (const int *)dlsym(_library, "simpleos_abi_version") : NULL;
+    const int *count = _library ? (const int *)dlsym(_library, "simpleos_block_count") : NULL;
+    const AotBlockFn *table = _library ? (const AotBlockFn *)dlsym(_library, "simpleos_blocks") : NULL;
+    if(!version || !count || !table || *version != AOT_ABI_VERSION || *count != (int)_blocks.size())
+    {
+        fprintf(stderr, "AOT: %s is missing or out of date; interpreting instead.\n", library.c_str());
+        _code.assign(_size, 0);
+        return false;
+    }
+
+    for(size_t b = 0; b < _blocks.size(); b++)
+    {
+        _blocks[b].fn = table[b];
+        _blocks[b].valid = true;
+    }
+    return true;
+}
+
+void AotProgram::protect(int addr, int length)
+{
+    for(int i = 0; i < length && addr + i < _size; i++)
+    {
+        if(addr + i >= 0)
+            _code[addr + i] = 1;
+    }
+}
+
+void AotProgram::invalidate(int addr)
+{
+    for(size_t b = 0; b < _blocks.size(); b++)
+    {
+        if(_blocks[b].valid && addr >= _blocks[b].start && addr < _blocks[b].end)
+        {
+            _blocks[b].valid = false;
+            invalidations++;
+        }
+    }
+}
+
+void AotProgram::report(FILE *out) const
+{
+    long total = compiled_instructions + interpreted_instructions;
+    fprintf(out, "\n--- AOT Report ---\n");
+    fprintf(out, "Blocks:                   %zu\n", _blocks.size());
+    fprintf(out, "Compiled instructions:    %ld (%.1f%%)\n", compiled_instructions,
+            total ? 100.0 * compiled_instructions / total : 0.0);
+    fprintf(out, "Interpreted instructions: %ld\n", interpreted_instructions);
+    fprintf(out, "Invalidated blocks:       %ld\n", invalidations);
+}
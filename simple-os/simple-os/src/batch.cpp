@@ -0,0 +1,824 @@
+//
+//  batch.cpp
+//
+// This file contains the implementation of the BatchEngine. The lanes
+// parked at the lowest PC are always gathered first, since lanes that have
+// fallen behind (for example, by leaving a loop later than the rest) can
+// only catch up if they run first. A group stops to let them catch up as
+// soon as it would move past the lowest parked lane. While a group runs,
+// each instruction is decoded once for all of its lanes, and an operand or
+// a value in memory that no lane has written is read once from the shared
+// image. Register arithmetic and conditional jumps are done with vector
+// instructions over the packed registers; stack and memory accesses that
+// differ between lanes are made lane by lane. Each lane draws its random
+// numbers from its own xorshift generator rather than rand(), so that a
+// lane gives the same results however many other lanes run beside it.
+//
+
+#include "batch.hpp"
+#include "cpu.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The number of operand words that follow each instruction.
+static int operandCount(int instr)
+{
+    switch(instr)
+    {
+        case Load_Val: case Load_Addr: case LoadInd_Addr: case LoadIdxX_Addr: case LoadIdxY_Addr:
+        case Store_Addr: case Put_Port: case Jump_Addr: case JumpIfEqual_Addr:
+        case JumpIfNotEqual_Addr: case Call_Addr:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Adds src to dst in every lane.
+static void vectorAdd(int *dst, const int *src, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(d, s));
+    }
+#elif defined(__SSE2__)
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(d, s));
+    }
+#endif
+    for(; i < n; i++)
+        dst[i] += src[i];
+}
+
+// Subtracts src from dst in every lane.
+static void vectorSub(int *dst, const int *src, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi32(d, s));
+    }
+#elif defined(__SSE2__)
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi32(d, s));
+    }
+#endif
+    for(; i < n; i++)
+        dst[i] -= src[i];
+}
+
+// Adds a constant to dst in every lane.
+static void vectorAddConst(int *dst, int val, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i v = _mm256_set1_epi32(val);
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(d, v));
+    }
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi32(val);
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(d, v));
+    }
+#endif
+    for(; i < n; i++)
+        dst[i] += val;
+}
+
+// Sets dst to taken in every lane where (src == 0) matches zero, and to
+// not_taken in the rest.
+static void vectorSelect(int *dst, const int *src, bool zero, int taken, int not_taken, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i t = _mm256_set1_epi32(zero ? taken : not_taken);
+    __m256i f = _mm256_set1_epi32(zero ? not_taken : taken);
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i m = _mm256_cmpeq_epi32(s, _mm256_setzero_si256());
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_blendv_epi8(f, t, m));
+    }
+#elif defined(__SSE2__)
+    __m128i t = _mm_set1_epi32(zero ? taken : not_taken);
+    __m128i f = _mm_set1_epi32(zero ? not_taken : taken);
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i m = _mm_cmpeq_epi32(s, _mm_setzero_si128());
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(m, t), _mm_andnot_si128(m, f)));
+    }
+#endif
+    for(; i < n; i++)
+        dst[i] = ((src[i] == 0) == zero) ? taken : not_taken;
+}
+
+// Finds the lowest and highest value held by any lane.
+static void laneRange(const int *src, int n, int &lo, int &hi)
+{
+    lo = hi = src[0];
+    for(int i = 1; i < n; i++)
+    {
+        lo = std::min(lo, src[i]);
+        hi = std::max(hi, src[i]);
+    }
+}
+
+const char *BatchEngine::simd()
+{
+#if defined(__AVX2__)
+    return "AVX2";
+#elif defined(__SSE2__)
+    return "SSE2";
+#else
+    return "portable";
+#endif
+}
+
+BatchEngine::BatchEngine(const int *image, int size, int lanes, int timer, unsigned seed)
+{
+    _lanes = lanes;
+    _timer = timer;
+    _running = lanes;
+    _lowest = INT_MAX;
+    _groups = 0;
+    _gathers = 0;
+    _stopped = false;
+
+    // The registers start out just as they do for the CPU.
+    _PC.assign(lanes, 0);
+    _SP.assign(lanes, 1000);
+    _AC.assign(lanes, 0);
+    _X.assign(lanes, 0);
+    _Y.assign(lanes, 0);
+    _mode.assign(lanes, USER);
+    _time.assign(lanes, 0);
+    _output.resize(lanes);
+
+    // xorshift never leaves a state of zero, so one is never used.
+    _rng.resize(lanes);
+    for(int i = 0; i < lanes; i++)
+    {
+        _rng[i] = (seed + i) * 2654435761u + 1;
+        if(_rng[i] == 0)
+            _rng[i] = 1;
+    }
+
+    _parked.resize(PARTITION_SIZE);
+    for(int i = 0; i < WAIT_WORDS; i++)
+        _waiting[i] = 0;
+
+    // A group may hold every lane at once.
+    _group.size = 0;
+    _group.lane.resize(lanes);
+    _group.PC.resize(lanes);
+    _group.SP.resize(lanes);
+    _group.AC.resize(lanes);
+    _group.X.resize(lanes);
+    _group.Y.resize(lanes);
+    _group.mode.resize(lanes);
+    _group.time.resize(lanes);
+    _group.op.resize(lanes);
+    _group.rng.resize(lanes);
+
+    // The image is padded out to a whole number of pages, and every lane
+    // starts out pointing at the shared copy.
+    _image.assign(NUM_PAGES * PAGE_SIZE, 0);
+    memcpy(&_image[0], image, (size < PARTITION_SIZE ? size : PARTITION_SIZE) * sizeof(int));
+    _pages.resize(lanes * NUM_PAGES);
+    _owned.assign(lanes * NUM_PAGES, 0);
+    _private.assign(NUM_PAGES, 0);
+    for(int i = 0; i < lanes; i++)
+    {
+        for(int page = 0; page < NUM_PAGES; page++)
+            _pages[i * NUM_PAGES + page] = &_image[page * PAGE_SIZE];
+    }
+}
+
+BatchEngine::~BatchEngine()
+{
+    for(size_t i = 0; i < _pages.size(); i++)
+    {
+        if(_owned[i])
+            delete[] _pages[i];
+    }
+}
+
+void BatchEngine::_fault(int lane, const std::string &msg)
+{
+    _output[lane] += msg;
+    _running--;
+}
+
+bool BatchEngine::_load(int lane, int mode, int addr, int &val)
+{
+    char msg[80];
+    if(addr >= 1000 && mode != KERNEL)
+    {
+        snprintf(msg, sizeof(msg), "ERROR: User attempted to read from address %d in system memory!\n", addr);
+        _fault(lane, msg);
+        return false;
+    }
+    if(addr < 0 || addr >= PARTITION_SIZE)
+    {
+        snprintf(msg, sizeof(msg), "ERROR: Address %d is outside of the program's memory!\n", addr);
+        _fault(lane, msg);
+        return false;
+    }
+    val = _pages[lane * NUM_PAGES + (addr >> PAGE_BITS)][addr & (PAGE_SIZE - 1)];
+    return true;
+}
+
+bool BatchEngine::_store(int lane, int mode, int addr, int val)
+{
+    char msg[80];
+    if(addr >= 1000 && mode != KERNEL)
+    {
+        snprintf(msg, sizeof(msg), "ERROR: User attempted to write %d to address %d in system memory!\n", val, addr);
+        _fault(lane, msg);
+        return false;
+    }
+    if(addr < 0 || addr >= PARTITION_SIZE)
+    {
+        snprintf(msg, sizeof(msg), "ERROR: Address %d is outside of the program's memory!\n", addr);
+        _fault(lane, msg);
+        return false;
+    }
+
+    // The first write to a shared page gives this lane a copy of its own.
+    int slot = lane * NUM_PAGES + (addr >> PAGE_BITS);
+    if(!_owned[slot])
+    {
+        int *copy = new int[PAGE_SIZE];
+        memcpy(copy, _pages[slot], PAGE_SIZE * sizeof(int));
+        _pages[slot] = copy;
+        _owned[slot] = 1;
+        _private[addr >> PAGE_BITS]++;
+    }
+    _pages[slot][addr & (PAGE_SIZE - 1)] = val;
+    return true;
+}
+
+bool BatchEngine::_shared(int addr) const
+{
+    if(addr < 0 || addr >= PARTITION_SIZE || _private[addr >> PAGE_BITS] != 0)
+        return false;
+
+    // User lanes would fault on system memory, so those reads are left to
+    // each lane.
+    if(addr >= 1000)
+    {
+        for(int k = 0; k < _group.size; k++)
+        {
+            if(_group.mode[k] != KERNEL)
+                return false;
+        }
+    }
+    return true;
+}
+
+void BatchEngine::_park(int lane)
+{
+    // A lane that the CPU would fault on when fetching its next instruction
+    // is stopped straight away, with the same message.
+    int pc = _PC[lane];
+    if(pc < 0 || pc >= PARTITION_SIZE || (pc >= 1000 && _mode[lane] != KERNEL))
+    {
+        int word;
+        _load(lane, _mode[lane], pc, word);
+        return;
+    }
+
+    _parked[pc].push_back(lane);
+    _waiting[pc >> 6] |= 1ULL << (pc & 63);
+    if(pc < _lowest)
+        _lowest = pc;
+}
+
+void BatchEngine::_gather(int pc)
+{
+    Group &g = _group;
+    std::vector<int> &parked = _parked[pc];
+    g.size = parked.size();
+    for(int k = 0; k < g.size; k++)
+    {
+        int lane = parked[k];
+        g.lane[k] = lane;
+        g.SP[k] = _SP[lane];
+        g.AC[k] = _AC[lane];
+        g.X[k] = _X[lane];
+        g.Y[k] = _Y[lane];
+        g.mode[k] = _mode[lane];
+        g.time[k] = _time[lane];
+        g.rng[k] = _rng[lane];
+    }
+    parked.clear();
+    _waiting[pc >> 6] &= ~(1ULL << (pc & 63));
+    _gathers++;
+
+    g.branched = false;
+    g.recheck = false;
+    g.elapsed = 0;
+    g.deadline = _deadline();
+
+    // The group must stop for the next lanes waiting behind it.
+    _lowest = INT_MAX;
+    for(int i = 0; i < WAIT_WORDS; i++)
+    {
+        if(_waiting[i])
+        {
+            _lowest = i * 64 + __builtin_ctzll(_waiting[i]);
+            break;
+        }
+    }
+}
+
+void BatchEngine::_release(int k)
+{
+    Group &g = _group;
+    int lane = g.lane[k];
+    _PC[lane] = g.PC[k];
+    _SP[lane] = g.SP[k];
+    _AC[lane] = g.AC[k];
+    _X[lane] = g.X[k];
+    _Y[lane] = g.Y[k];
+    _mode[lane] = g.mode[k];
+    _time[lane] = g.time[k] + g.elapsed;
+    _rng[lane] = g.rng[k];
+    _park(lane);
+    g.lane[k] = -1;
+    _stopped = true;
+}
+
+void BatchEngine::_scatter(int next)
+{
+    Group &g = _group;
+    if(!g.branched)
+        std::fill(&g.PC[0], &g.PC[0] + g.size, next);
+    for(int k = 0; k < g.size; k++)
+        _release(k);
+    g.size = 0;
+    _stopped = false;
+}
+
+void BatchEngine::_compact()
+{
+    // The order of lanes in a group does not matter, so each lane that has
+    // gone is replaced by the last one.
+    Group &g = _group;
+    for(int k = g.size - 1; k >= 0; k--)
+    {
+        if(g.lane[k] >= 0)
+            continue;
+        int last = --g.size;
+        if(k == last)
+            continue;
+        g.lane[k] = g.lane[last];
+        g.PC[k] = g.PC[last];
+        g.SP[k] = g.SP[last];
+        g.AC[k] = g.AC[last];
+        g.X[k] = g.X[last];
+        g.Y[k] = g.Y[last];
+        g.mode[k] = g.mode[last];
+        g.time[k] = g.time[last];
+        g.rng[k] = g.rng[last];
+    }
+    _stopped = false;
+}
+
+int BatchEngine::_deadline() const
+{
+    const Group &g = _group;
+    int deadline = INT_MAX;
+    for(int k = 0; k < g.size; k++)
+    {
+        if(g.mode[k] != KERNEL)
+            deadline = std::min(deadline, _timer - g.time[k]);
+    }
+    return deadline;
+}
+
+void BatchEngine::_tick(int next)
+{
+    Group &g = _group;
+    vectorAddConst(&g.time[0], g.elapsed, g.size);
+    g.elapsed = 0;
+
+    for(int k = 0; k < g.size; k++)
+    {
+        if(g.mode[k] != KERNEL && g.time[k] >= _timer)
+        {
+            // The interrupt saves the PC, so every lane's PC has to be known.
+            if(!g.branched)
+            {
+                std::fill(&g.PC[0], &g.PC[0] + g.size, next);
+                g.branched = true;
+            }
+            g.time[k] = 0;
+            _interrupt(k, 1000);
+        }
+    }
+    g.recheck = false;
+    g.deadline = _deadline();
+}
+
+bool BatchEngine::_read(int k, int addr, int &val)
+{
+    if(_load(_group.lane[k], _group.mode[k], addr, val))
+        return true;
+    _group.lane[k] = -1;
+    _stopped = true;
+    return false;
+}
+
+bool BatchEngine::_write(int k, int addr, int val)
+{
+    if(_store(_group.lane[k], _group.mode[k], addr, val))
+        return true;
+    _group.lane[k] = -1;
+    _stopped = true;
+    return false;
+}
+
+bool BatchEngine::_push(int k, int val)
+{
+    _group.SP[k]--;
+    return _write(k, _group.SP[k], val);
+}
+
+bool BatchEngine::_pop(int k, int &val)
+{
+    // The value is only handed back after SP moves, since it may be SP itself.
+    int top;
+    if(!_read(k, _group.SP[k], top))
+        return false;
+    _group.SP[k]++;
+    val = top;
+    return true;
+}
+
+void BatchEngine::_interrupt(int k, int vector)
+{
+    Group &g = _group;
+    g.mode[k] = KERNEL;
+    int old_sp = g.SP[k];
+    g.SP[k] = 2000;
+    if(_push(k, old_sp) && _push(k, g.PC[k]))
+        g.PC[k] = vector;
+}
+
+int BatchEngine::_fetch(int pc)
+{
+    Group &g = _group;
+
+    // Lanes in user mode may have been carried into system memory.
+    if(pc >= 1000)
+    {
+        int word;
+        for(int k = 0; k < g.size; k++)
+        {
+            if(g.mode[k] != KERNEL)
+                _read(k, pc, word);
+        }
+        if(_stopped)
+            _compact();
+    }
+    if(g.size == 0 || _private[pc >> PAGE_BITS] == 0)
+        return _image[pc];
+
+    // Some lane has written near here, so the first lane decides the
+    // instruction and any lane that wrote something else waits until it has run.
+    const int page = pc >> PAGE_BITS, offset = pc & (PAGE_SIZE - 1);
+    int instr = _pages[g.lane[0] * NUM_PAGES + page][offset];
+    for(int k = 1; k < g.size; k++)
+    {
+        if(_pages[g.lane[k] * NUM_PAGES + page][offset] != instr)
+        {
+            g.PC[k] = pc;
+            _release(k);
+        }
+    }
+    if(_stopped)
+        _compact();
+    return instr;
+}
+
+bool BatchEngine::_operand(int pc, int &op)
+{
+    if(_shared(pc + 1))
+    {
+        op = _image[pc + 1];
+        return true;
+    }
+    for(int k = 0; k < _group.size; k++)
+        _read(k, pc + 1, _group.op[k]);
+    return false;
+}
+
+int BatchEngine::_execute(int pc, int instr)
+{
+    Group &g = _group;
+    const int n = g.size;
+    int *lane = &g.lane[0], *PC = &g.PC[0], *SP = &g.SP[0], *AC = &g.AC[0], *X = &g.X[0], *Y = &g.Y[0];
+
+    // Every lane moves past the instruction unless it jumps. Only branches
+    // fill in a PC for each lane; otherwise they all go on to the same one.
+    int next = pc + 1 + operandCount(instr);
+    g.branched = false;
+
+    // An operand that every lane shares is read once. Otherwise each lane
+    // has its own in g.op (and any lane that faulted reading it has stopped).
+    int op = 0;
+    bool shared = true;
+    if(operandCount(instr))
+        shared = _operand(pc, op);
+    const int *ops = &g.op[0];
+
+    int val;
+    switch(instr)
+    {
+        case Load_Val:
+            if(shared)
+                std::fill(AC, AC + n, op);
+            else
+            {
+                for(int k = 0; k < n; k++)
+                    AC[k] = ops[k];
+            }
+            break;
+
+        case Load_Addr:
+            if(shared && _shared(op))
+                std::fill(AC, AC + n, _image[op]);
+            else
+            {
+                for(int k = 0; k < n; k++)
+                {
+                    if(lane[k] >= 0 && _read(k, shared ? op : ops[k], val))
+                        AC[k] = val;
+                }
+            }
+            break;
+
+        case LoadInd_Addr:
+            for(int k = 0; k < n; k++)
+            {
+                if(lane[k] >= 0 && _read(k, shared ? op : ops[k], val) && _read(k, val, val))
+                    AC[k] = val;
+            }
+            break;
+
+        case LoadIdxX_Addr:
+            for(int k = 0; k < n; k++)
+            {
+                if(lane[k] >= 0 && _read(k, (shared ? op : ops[k]) + X[k], val))
+                    AC[k] = val;
+            }
+            break;
+
+        case LoadIdxY_Addr:
+            for(int k = 0; k < n; k++)
+            {
+                if(lane[k] >= 0 && _read(k, (shared ? op : ops[k]) + Y[k], val))
+                    AC[k] = val;
+            }
+            break;
+
+        case LoadSpX:
+            for(int k = 0; k < n; k++)
+            {
+                if(_read(k, SP[k] + X[k], val))
+                    AC[k] = val;
+            }
+            break;
+
+        case Store_Addr:
+            for(int k = 0; k < n; k++)
+            {
+                if(lane[k] >= 0)
+                    _write(k, shared ? op : ops[k], AC[k]);
+            }
+            break;
+
+        case Get:
+        {
+            unsigned *rng = &g.rng[0];
+            for(int k = 0; k < n; k++)
+            {
+                unsigned x = rng[k];
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                rng[k] = x;
+                AC[k] = (x % 100) + 1;
+            }
+            break;
+        }
+
+        case Put_Port:
+            for(int k = 0; k < n; k++)
+            {
+                int port = shared ? op : ops[k];
+                if(lane[k] < 0)
+                    continue;
+                if(port == 1)
+                    _output[lane[k]] += std::to_string(AC[k]);
+                else if(port == 2)
+                    _output[lane[k]] += (char)AC[k];
+            }
+            break;
+
+        case AddX:       vectorAdd(AC, X, n); break;
+        case AddY:       vectorAdd(AC, Y, n); break;
+        case SubX:       vectorSub(AC, X, n); break;
+        case SubY:       vectorSub(AC, Y, n); break;
+        case CopyToX:    std::copy(AC, AC + n, X); break;
+        case CopyFromX:  std::copy(X, X + n, AC); break;
+        case CopyToY:    std::copy(AC, AC + n, Y); break;
+        case CopyFromY:  std::copy(Y, Y + n, AC); break;
+        case CopyToSp:   std::copy(AC, AC + n, SP); break;
+        case CopyFromSp: std::copy(SP, SP + n, AC); break;
+        case IncX:       vectorAddConst(X, 1, n); break;
+        case DecX:       vectorAddConst(X, -1, n); break;
+
+        case Jump_Addr:
+            if(shared)
+                next = op;
+            else
+            {
+                std::copy(ops, ops + n, PC);
+                g.branched = true;
+            }
+            break;
+
+        case JumpIfEqual_Addr:
+        case JumpIfNotEqual_Addr:
+        {
+            bool zero = (instr == JumpIfEqual_Addr);
+            if(shared)
+                vectorSelect(PC, AC, zero, op, next, n);
+            else
+            {
+                for(int k = 0; k < n; k++)
+                    PC[k] = ((AC[k] == 0) == zero) ? ops[k] : next;
+            }
+            g.branched = true;
+            break;
+        }
+
+        case Call_Addr:
+            for(int k = 0; k < n; k++)
+            {
+                if(lane[k] >= 0)
+                    _push(k, next);
+            }
+            if(shared)
+                next = op;
+            else
+            {
+                std::copy(ops, ops + n, PC);
+                g.branched = true;
+            }
+            break;
+
+        case Ret:
+            for(int k = 0; k < n; k++)
+            {
+                if(_pop(k, val))
+                    PC[k] = val;
+            }
+            g.branched = true;
+            break;
+
+        case Push:
+            for(int k = 0; k < n; k++)
+                _push(k, AC[k]);
+            break;
+
+        case Pop:
+            for(int k = 0; k < n; k++)
+            {
+                if(_pop(k, val))
+                    AC[k] = val;
+            }
+            break;
+
+        // Both of these change modes, so the timer has to be checked again.
+        case Int:
+            std::fill(PC, PC + n, next);
+            for(int k = 0; k < n; k++)
+            {
+                if(g.mode[k] != KERNEL)
+                    _interrupt(k, 1500);
+            }
+            g.branched = true;
+            g.recheck = true;
+            break;
+
+        case IRet:
+            std::fill(PC, PC + n, next);
+            for(int k = 0; k < n; k++)
+            {
+                if(g.mode[k] == KERNEL && _pop(k, PC[k]) && _pop(k, SP[k]))
+                    g.mode[k] = USER;
+            }
+            g.branched = true;
+            g.recheck = true;
+            break;
+
+        case End:
+            for(int k = 0; k < n; k++)
+                lane[k] = -1;
+            _running -= n;
+            _stopped = true;
+            break;
+    }
+    return next;
+}
+
+long BatchEngine::run()
+{
+    for(int i = 0; i < _lanes; i++)
+        _park(i);
+
+    Group &g = _group;
+    long total = 0;
+    while(_running > 0)
+    {
+        int pc = _lowest;
+        _gather(pc);
+
+        while(g.size > 0)
+        {
+            int instr = _fetch(pc);
+            if(g.size == 0)
+                break;
+
+            total += g.size;
+            _groups++;
+            int next = _execute(pc, instr);
+            if(_stopped)
+                _compact();
+
+            // Each lane keeps its own timer, but they all tick together, so
+            // they are only looked at once the first of them could expire.
+            g.elapsed++;
+            if(g.elapsed >= g.deadline || g.recheck)
+                _tick(next);
+            if(g.size == 0)
+                break;
+
+            // The lanes heading for the lowest PC carry on together, as long
+            // as that is not past a lane waiting to catch up; the rest are
+            // parked until the group reaches them.
+            if(g.branched)
+            {
+                int highest;
+                laneRange(&g.PC[0], g.size, next, highest);
+                if(highest != next && next >= 0 && next < PARTITION_SIZE && next < _lowest)
+                {
+                    for(int k = g.size - 1; k >= 0; k--)
+                    {
+                        if(g.PC[k] != next)
+                            _release(k);
+                    }
+                    _compact();
+                }
+            }
+            if(next < 0 || next >= PARTITION_SIZE || next >= _lowest)
+            {
+                _scatter(next);
+                break;
+            }
+            pc = next;
+        }
+    }
+    return total;
+}
@@ -17,7 +17,8 @@
 
 #include <string>
 
-CPU::CPU(int input_pipe, int output_pipe, int timer)
+CPU::CPU(int input_pipe, int output_pipe, int timer, TimingModel *timing, Scheduler *scheduler, AotProgram *aot,
+         Prefetcher *prefetch)
 {
     // Initialize all of the registers
     _PC = 0;    // Begin running user program from 0 in main memory
@@ -27,6 +28,10 @@ CPU::CPU(int input_pipe, int output_pipe, int timer)
     _X = 0;
     _Y = 0;
     
+    // A single program is given the whole of memory.
+    _base = 0;
+    _limit = PARTITION_SIZE;
+    
     // Attach the pipe handles to this class.
     _in = input_pipe;
     _out = output_pipe;
@@ -35,38 +40,264 @@ CPU::CPU(int input_pipe, int output_pipe, int timer)
     srand(time(NULL));
     _mode = USER;
     _timer_val = timer;
+    _time = 0;
+    
+    // The timing model only observes execution, so it may be left out entirely.
+    _timing = timing;
+    
+    // No native handlers are known until they are registered.
+    _longest_pattern = 0;
+    _force_interpret = false;
+    
+    // When several programs are loaded, start with the first one in the table.
+    _scheduler = scheduler;
+    if(_scheduler)
+        _restore(_scheduler->current());
+    
+    // A compiled program shares its memory with the CPU instead of using the pipes.
+    _aot = aot;
+    _local_mem = aot ? aot->memory() : NULL;
+    
+    // Prefetching is also optional, and learns from each instruction's reads.
+    _prefetch = prefetch;
+    _instr_addr = _PC;
+}
+
+void CPU::_save(Process &p)
+{
+    p.PC = _PC;
+    p.SP = _SP;
+    p.IR = _IR;
+    p.AC = _AC;
+    p.X = _X;
+    p.Y = _Y;
+    p.mode = _mode;
+    p.base = _base;
+    p.limit = _limit;
+}
+
+void CPU::_restore(const Process &p)
+{
+    _PC = p.PC;
+    _SP = p.SP;
+    _IR = p.IR;
+    _AC = p.AC;
+    _X = p.X;
+    _Y = p.Y;
+    _mode = p.mode;
+    _base = p.base;
+    _limit = p.limit;
+}
+
+bool CPU::_context_switch(bool finished)
+{
+    _save(_scheduler->current());
+    Process *next = _scheduler->next(finished);
+    if(!next)
+        return false;
+    
+    // The incoming process starts a fresh quantum.
+    _restore(*next);
+    _time = 0;
+    return true;
 }
 
 void CPU::execute()
 {
     while(_IR != End)
     {
-        // Read in the instruction stored at that address.
-        _IR = _read_address(_PC);
+        // Compiled blocks are preferred, but any instruction they cannot
+        // run is interpreted instead.
+        if(_aot)
+        {
+            if(_run_compiled())
+                continue;
+            _aot->interpreted_instructions++;
+        }
+        _step();
+    }
+    
+    if(_timing)
+        _timing->report(stderr);
+    if(_scheduler)
+        _scheduler->report(stderr);
+    if(_aot)
+        _aot->report(stderr);
+    if(_prefetch)
+        _prefetch->report(stderr);
+}
+
+void CPU::_step()
+{
+    // Read in the instruction stored at that address.
+    _instr_addr = _PC;
+    _IR = _read_address(_PC);
+    
+    // Once the instruction has been retrieved, process it. Note that
+    // End may switch to another process, replacing the IR.
+    int instr = _IR;
+    _PC++;
+    if(_scheduler)
+        _scheduler->tick();
+    _process();
+    if(_timing)
+        _timing->retire(instr);
+    
+    // When End hands the CPU to another process, that process has already
+    // been given a fresh quantum, which this instruction must not count against.
+    if(instr != End)
+        _time++;
+    _check_timer();
+}
+
+void CPU::_check_timer()
+{
+    // Check to see if there has been a timeout or not.
+    // Note that if the system is already performing a call, the timer
+    // will not yet interrupt, and neither will it once the program has ended.
+    while(_mode != KERNEL && _time >= _timer_val && _IR != End)
+    {
+        _time = 0;
         
-        // Once the instruction has been retrieved, process it.
-        _PC++;
-        _process();
+        // With several programs loaded, the timer switches to the next
+        // process natively instead of running a guest handler. Entering the
+        // kernel to make the switch still costs as much as any interrupt.
+        if(_scheduler)
+        {
+            if(_timing)
+                _timing->interrupt();
+            _context_switch(false);
+            break;
+        }
         
-        // Check to see if there has been a timeout or not.
-        // Note that if the system is already performing a call, the timer
-        // will not yet interrupt.
-        _time++;
-        if(_mode != KERNEL && _time >= _timer_val)
-        {
-            // When a timeout interrupt occurs, enter kernel mode
-            // and
-            _mode = KERNEL;
-            int old_sp = _SP;
-            _SP = 2000;         // End of system memory is where system stack begins
-            _push(old_sp);      // Store the current user memory stack pointer
-            _push(_PC);         // along with the current instruction in user memory
-            
-            // Finally, set current location to timeout handler (line 1000)
-            _PC = 1000;
-            _time = 0;
+        // Otherwise, enter kernel mode and run the timeout handler
+        // (line 1000). A native handler returns to user mode straight
+        // away, so the timer is checked again just as it would be after
+        // an interpreted IRet.
+        _interrupt(1000);
+    }
+}
+
+bool CPU::_run_compiled()
+{
+    AotBlockFn block = _aot->lookup(_PC, _mode != KERNEL);
+    if(!block)
+        return false;
+    
+    // The block keeps the registers in locals and hands them back when it returns.
+    AotState state = {_PC, _SP, _AC, _X, _Y, _mode, _time, _timer_val, _local_mem, _aot->code_map()};
+    int result = block(&state);
+    _aot->compiled_instructions += state.time - _time;
+    _PC = state.PC;
+    _SP = state.SP;
+    _AC = state.AC;
+    _X = state.X;
+    _Y = state.Y;
+    _time = state.time;
+    
+    // The instruction at the PC could not be compiled code, so the
+    // interpreter must perform it next.
+    if(result == AOT_INTERPRET)
+        return false;
+    
+    _check_timer();
+    return true;
+}
+
+void CPU::_interrupt(int vector)
+{
+    if(_timing)
+        _timing->interrupt();
+    _mode = KERNEL;
+    int old_sp = _SP;
+    _SP = 2000;         // End of system memory is where system stack begins
+    _push(old_sp);      // Store the current user memory stack pointer
+    _push(_PC);         // along with the current instruction in user memory
+    
+    // Finally, set current location to the handler.
+    InterruptFrame frame = {vector, _PC, old_sp, NULL};
+    _PC = vector;
+    
+    // A native handler finishes the whole handler at once, so it is charged
+    // for every instruction that the interpreter would have counted. The
+    // timing model needs to see each of those fetches and stack accesses,
+    // so handlers are always interpreted while it is attached.
+    if(!_force_interpret && !_timing)
+    {
+        NativeHandler *handler = _find_handler(frame);
+        if(handler)
+        {
+            int count = handler->run(*this, frame);
+            _time += count;
+            if(_scheduler)
+                _scheduler->tick(count);
+        }
+    }
+}
+
+NativeHandler *CPU::_find_handler(InterruptFrame &frame)
+{
+    // Handlers registered for a vector always take priority.
+    std::map<int, NativeHandler *>::iterator registered = _vector_handlers.find(frame.vector);
+    if(registered != _vector_handlers.end())
+        return registered->second;
+    if(_patterns.empty())
+        return NULL;
+    
+    // The first time a vector is entered, read enough of its code to compare
+    // against every pattern and remember the result. Each partition has its
+    // own handlers, so they are remembered by physical address.
+    std::map<int, HandlerPattern>::iterator matched = _matched.find(_base + frame.vector);
+    if(matched == _matched.end())
+    {
+        HandlerPattern found;
+        found.handler = NULL;
+        for(int i = 0; i < (int)_longest_pattern && frame.vector + i < _limit; i++)
+            found.code.push_back(_memory_read(_base + frame.vector + i));
+        
+        for(size_t p = 0; p < _patterns.size() && !found.handler; p++)
+        {
+            const std::vector<int> &pattern = _patterns[p].code;
+            size_t i = 0;
+            while(i < pattern.size() && i < found.code.size() &&
+                  (pattern[i] == ANY_WORD || pattern[i] == found.code[i]))
+                i++;
+            if(i == pattern.size())
+                found.handler = _patterns[p].handler;
         }
+        matched = _matched.insert(std::make_pair(_base + frame.vector, found)).first;
+        
+        // Compiled code must not write over a matched handler behind our back,
+        // or the match would never be forgotten.
+        if(_aot)
+            _aot->protect(_base + frame.vector, found.code.size());
     }
+    
+    frame.code = &matched->second.code;
+    return matched->second.handler;
+}
+
+void CPU::register_handler(int vector, NativeHandler *handler)
+{
+    _vector_handlers[vector] = handler;
+}
+
+void CPU::register_handler(const std::vector<int> &pattern, NativeHandler *handler)
+{
+    HandlerPattern entry;
+    entry.code = pattern;
+    entry.handler = handler;
+    _patterns.push_back(entry);
+    
+    // Any earlier matches need to be redone against the new pattern.
+    if(pattern.size() > _longest_pattern)
+        _longest_pattern = pattern.size();
+    _matched.clear();
+}
+
+void CPU::force_interpreter(bool force)
+{
+    _force_interpret = force;
 }
 
 int CPU::_read_address(int addr)
@@ -79,6 +310,45 @@ int CPU::_read_address(int addr)
         exit(1);
     }
     
+    int physical = _relocate(addr);
+    if(_timing)
+        _timing->access(physical);
+    int val = _memory_read(physical);
+    
+    // Reads at the PC are instruction and operand fetches, which form their
+    // own sequential stream. In user mode, nothing past the user program
+    // may be prefetched.
+    if(_prefetch)
+    {
+        int hi = (_mode != KERNEL && _limit > 1000) ? 1000 : _limit;
+        _prefetch->train(_instr_addr, addr, addr == _PC, 0, hi, _base);
+    }
+    return val;
+}
+
+int CPU::_relocate(int addr)
+{
+    // Every address must fall within the partition given to the process.
+    if(addr < 0 || addr >= _limit)
+    {
+        printf("ERROR: Address %d is outside of the program's memory!\n", addr);
+        _terminate();
+        exit(1);
+    }
+    return _base + addr;
+}
+
+int CPU::_memory_read(int addr)
+{
+    if(_local_mem)
+        return _local_mem[addr];
+    
+    // A prefetched value saves a round trip. Otherwise, the prefetcher
+    // collects its outstanding replies so that ours is the next to arrive.
+    int val;
+    if(_prefetch && _prefetch->lookup(addr, val))
+        return val;
+    
     // Notify that a read op will occur and then request an address.
     CMD read_next = READ;
     write(_out, &read_next, sizeof(CMD));
@@ -86,7 +356,6 @@ int CPU::_read_address(int addr)
     write(_out, &addr, sizeof(int));
     
     // Read in the value that is stored at that address.
-    int val;
     read(_in, &val, sizeof(int));
     return(val);
 }
@@ -98,11 +367,38 @@ void CPU::_write(int addr, int val)
     {
         // Notify the user that the process failed and exit to avoid damaging memory.
         printf("ERROR: User attempted to write %d to address %d in system memory!\n", val, addr);
-        CMD term = TERMINATE;
-        write(_out, &term, sizeof(CMD));
+        _terminate();
         exit(1);
     }
     
+    addr = _relocate(addr);
+    if(_timing)
+        _timing->access(addr);
+    
+    // If the guest rewrites a handler that was matched to a pattern, it has
+    // to be matched again the next time it is entered.
+    std::map<int, HandlerPattern>::iterator matched = _matched.begin();
+    while(matched != _matched.end())
+    {
+        if(addr >= matched->first && addr < matched->first + (int)matched->second.code.size())
+            _matched.erase(matched++);
+        else
+            matched++;
+    }
+    
+    // Memory shared with compiled code is written directly, and any blocks
+    // that the write lands on can no longer be used.
+    if(_local_mem)
+    {
+        _local_mem[addr] = val;
+        if(_aot->covers(addr))
+            _aot->invalidate(addr);
+        return;
+    }
+    
+    if(_prefetch)
+        _prefetch->invalidate(addr);
+    
     // Notify that next op will be a write, then send over the address.
     CMD write_next = WRITE;
     write(_out, &write_next, sizeof(CMD));
@@ -113,6 +409,16 @@ void CPU::_write(int addr, int val)
     write(_out, &val, sizeof(int));
 }
 
+void CPU::_terminate()
+{
+    // Memory shared with compiled code has no process to shut down.
+    if(_local_mem)
+        return;
+    
+    CMD term = TERMINATE;
+    write(_out, &term, sizeof(CMD));
+}
+
 void CPU::_push(int number)
 {
     // First, we store the number in the next available stack spot, and then move pointer
@@ -378,16 +684,12 @@ void CPU::_process()
         case Int:
         {
             // Nested interrupts are disabled during system calls or vice versa.
+            // The interrupt handler begins at line 1500.
             if(_mode != KERNEL)
             {
-                _mode = KERNEL;
-                int old_sp = _SP;
-                _SP = 2000;         // End of system memory is where system stack begins
-                _push(old_sp);      // Store the current user memory stack pointer
-                _push(_PC);         // along with the current instruction in user memory
-                
-                // Finally, set current location to interrupt handler (line 1500)
-                _PC = 1500;
+                if(_scheduler)
+                    _scheduler->current().syscalls++;
+                _interrupt(1500);
             }
             break;
         }
@@ -407,11 +709,15 @@ void CPU::_process()
             break;
         }
 
-        // This command simply ends the program. There is no shutdown processing needed.
+        // This command simply ends the program. There is no shutdown processing needed,
+        // unless other programs are still waiting to run, in which case the next one
+        // takes over the CPU.
         case End:
         {
-            CMD term = TERMINATE;
-            write(_out, &term, sizeof(CMD));
+            if(_scheduler && _context_switch(true))
+                break;
+            
+            _terminate();
             break;
         }
     }
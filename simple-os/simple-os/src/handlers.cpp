@@ -0,0 +1,119 @@
+//
+//  handlers.cpp
+//
+// This file contains the accessors that native handlers use to reach into
+// the CPU, along with the built-in handlers that the simulator recognizes.
+// Each built-in handler writes the same values to the system stack that
+// the interpreted handler would have pushed, so that memory is left in the
+// same state either way, but it skips reading them back when it can.
+//
+
+#include "handlers.hpp"
+#include "cpu.hpp"
+
+int &NativeHandler::PC(CPU &cpu) { return cpu._PC; }
+int &NativeHandler::SP(CPU &cpu) { return cpu._SP; }
+int &NativeHandler::AC(CPU &cpu) { return cpu._AC; }
+int &NativeHandler::X(CPU &cpu) { return cpu._X; }
+int &NativeHandler::Y(CPU &cpu) { return cpu._Y; }
+bool &NativeHandler::mode(CPU &cpu) { return cpu._mode; }
+
+int NativeHandler::read(CPU &cpu, int addr)
+{
+    return cpu._read_address(addr);
+}
+
+void NativeHandler::write(CPU &cpu, int addr, int val)
+{
+    cpu._write(addr, val);
+}
+
+void NativeHandler::push(CPU &cpu, int val)
+{
+    cpu._push(val);
+}
+
+void NativeHandler::iret(CPU &cpu, const InterruptFrame &frame)
+{
+    cpu._PC = frame.saved_pc;
+    cpu._SP = frame.saved_sp;
+    cpu._mode = USER;
+}
+
+int ReturnHandler::run(CPU &cpu, const InterruptFrame &frame)
+{
+    iret(cpu, frame);
+    return 1;
+}
+
+int CounterHandler::run(CPU &cpu, const InterruptFrame &frame)
+{
+    // Keep a copy of the five stack words the handler touches: the three
+    // saved registers below SP, then the saved PC and SP of the interrupt.
+    int base = SP(cpu) - 3;
+    int stack[5] = {Y(cpu), X(cpu), AC(cpu), frame.saved_pc, frame.saved_sp};
+    push(cpu, AC(cpu));
+    push(cpu, X(cpu));
+    push(cpu, Y(cpu));
+
+    // Load a, CopyToX, IncX, CopyFromX, Store b
+    int src = (*frame.code)[6],
+        dest = (*frame.code)[11];
+    int val = read(cpu, src) + 1;
+    write(cpu, dest, val);
+
+    // If the store landed on the stack, the pops will see the new value.
+    if(dest >= base && dest < base + 5)
+        stack[dest - base] = val;
+
+    // Pop, CopyToY, Pop, CopyToX, Pop, IRet
+    Y(cpu) = stack[0];
+    X(cpu) = stack[1];
+    AC(cpu) = stack[2];
+    PC(cpu) = stack[3];
+    SP(cpu) = stack[4];
+    mode(cpu) = USER;
+    return 16;
+}
+
+int PrintHandler::run(CPU &cpu, const InterruptFrame &frame)
+{
+    push(cpu, AC(cpu));
+    push(cpu, X(cpu));
+    push(cpu, Y(cpu));
+
+    // Load a, Put 1, Load 10, Put 2
+    printf("%d", read(cpu, (*frame.code)[6]));
+    printf("%c", 10);
+
+    // Nothing was written besides the pushes, so popping them back leaves
+    // every register as it was.
+    iret(cpu, frame);
+    return 15;
+}
+
+void RegisterBuiltinHandlers(CPU &cpu)
+{
+    static ReturnHandler return_handler;
+    static CounterHandler counter_handler;
+    static PrintHandler print_handler;
+
+    // Handlers that save and restore every register around their body.
+    const int save[] = {Push, CopyFromX, Push, CopyFromY, Push};
+    const int restore[] = {Pop, CopyToY, Pop, CopyToX, Pop, IRet};
+    const int count[] = {Load_Addr, ANY_WORD, CopyToX, IncX, CopyFromX, Store_Addr, ANY_WORD};
+    const int print[] = {Load_Addr, ANY_WORD, Put_Port, 1, Load_Val, 10, Put_Port, 2};
+
+    std::vector<int> pattern(1, IRet);
+    cpu.register_handler(pattern, &return_handler);
+
+    pattern.assign(save, save + 5);
+    pattern.insert(pattern.end(), count, count + 7);
+    pattern.insert(pattern.end(), restore, restore + 6);
+    cpu.register_handler(pattern, &counter_handler);
+
+    pattern.assign(save, save + 5);
+    pattern.insert(pattern.end(), print, print + 8);
+    pattern.insert(pattern.end(), restore, restore + 6);
+    cpu.register_handler(pattern, &print_handler);
+}
@@ -13,10 +13,17 @@
 #include <iostream>
 #include <unistd.h>
 #include <string>
+#include <ctime>
 
 // Headers for each half of the simulated machine to allow branching.
 #include "memory.hpp"
 #include "cpu.hpp"
+#include "aot.hpp"
+#include "batch.hpp"
+#include "handlers.hpp"
+#include "prefetch.hpp"
+#include "scheduler.hpp"
+#include "timing.hpp"
 
 /**
  * Provides a common framework for displaying and handling errors. Additional error-handling logic
@@ -31,13 +38,218 @@ void logError(std::string msg, int code = -1)
     exit(code);
 }
 
+/**
+ * Parses a cache level description of the form size:line_size:ways:latency.
+ *
+ * @arg spec: The text following the option's '=' sign.
+ * @arg level: The cache configuration to fill in.
+ */
+void parseCacheSpec(std::string spec, CacheConfig &level)
+{
+    if(sscanf(spec.c_str(), "%d:%d:%d:%d", &level.size, &level.line_size, &level.ways, &level.latency) != 4)
+        logError("Error: Cache levels must be given as size:line_size:ways:latency!");
+    
+    // A size of 0 turns the level off; otherwise the geometry must divide evenly into sets.
+    if(level.size != 0 && (level.line_size <= 0 || level.ways <= 0 ||
+                           level.size % (level.line_size * level.ways) != 0))
+        logError("Error: Cache size must be a multiple of line_size * ways!");
+}
+
+/**
+ * Parses a single --option=value argument into the timing configuration.
+ *
+ * @arg arg: The full argument, including the leading dashes.
+ * @arg config: The timing configuration to update.
+ * @return: Whether the argument was a timing option.
+ */
+bool parseTimingOption(std::string arg, TimingConfig &config)
+{
+    // The names accepted by --cycles, in the same order as OP_CLASS.
+    const char *class_names[NUM_OP_CLASSES] = {"alu", "mem", "branch", "stack", "io", "sys"};
+    
+    size_t eq = arg.find('=');
+    std::string name = arg.substr(0, eq);
+    std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+    
+    if(name == "--timing")
+        return true;
+    else if(name == "--l1")
+        parseCacheSpec(value, config.l1);
+    else if(name == "--l2")
+        parseCacheSpec(value, config.l2);
+    else if(name == "--mem-latency")
+        config.mem_latency = std::atoi(value.c_str());
+    else if(name == "--int-cost")
+        config.interrupt_cost = std::atoi(value.c_str());
+    else if(name == "--cycles")
+    {
+        // Given as class:cycles, such as --cycles=branch:3
+        size_t colon = value.find(':');
+        std::string cls = value.substr(0, colon);
+        int i = 0;
+        while(i < NUM_OP_CLASSES && cls != class_names[i])
+            i++;
+        if(colon == std::string::npos || i == NUM_OP_CLASSES)
+            logError("Error: --cycles expects one of alu, mem, branch, stack, io or sys as class:cycles!");
+        config.class_cycles[i] = std::atoi(value.c_str() + colon + 1);
+    }
+    else
+        return false;
+    return true;
+}
+
+// Seconds elapsed since a starting point on the monotonic clock.
+double secondsSince(const timespec &start)
+{
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Runs many copies of a program as lanes of one batch, then runs each copy
+ * again on its own with the same seed to compare throughput and results.
+ * Every lane's output is printed to stdout and the comparison to stderr.
+ *
+ * @arg image: The loaded program image.
+ * @arg size: The number of words in the image.
+ * @arg lanes: The number of copies to run.
+ * @arg timer: The number of instructions that can pass before a timer interrupt occurs.
+ * @arg seed: The random seed of the first copy.
+ */
+void runBatch(const int *image, int size, int lanes, int timer, unsigned seed)
+{
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    BatchEngine batch(image, size, lanes, timer, seed);
+    long batch_instructions = batch.run();
+    double batch_seconds = secondsSince(start);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long single_instructions = 0;
+    int mismatches = 0;
+    for(int i = 0; i < lanes; i++)
+    {
+        BatchEngine single(image, size, 1, timer, seed + i);
+        single_instructions += single.run();
+        if(single.output(0) != batch.output(i))
+            mismatches++;
+    }
+    double single_seconds = secondsSince(start);
+    
+    for(int i = 0; i < lanes; i++)
+        printf("--- Lane %d (seed %u) ---\n%s\n", i, seed + i, batch.output(i).c_str());
+    fflush(stdout);
+    
+    fprintf(stderr, "\n--- Batch Report (%s) ---\n", BatchEngine::simd());
+    fprintf(stderr, "Lanes:            %d\n", lanes);
+    fprintf(stderr, "Instructions:     %ld\n", batch_instructions);
+    fprintf(stderr, "Groups:           %ld (%.2f lanes each)\n", batch.groups(),
+            batch.groups() ? (double)batch_instructions / batch.groups() : 0.0);
+    fprintf(stderr, "Gathers:          %ld\n", batch.gathers());
+    fprintf(stderr, "Lockstep:         %.0f instr/sec (%.3fs)\n",
+            batch_seconds > 0 ? batch_instructions / batch_seconds : 0.0, batch_seconds);
+    fprintf(stderr, "One at a time:    %.0f instr/sec (%.3fs)\n",
+            single_seconds > 0 ? single_instructions / single_seconds : 0.0, single_seconds);
+    fprintf(stderr, "Speedup:          %.2fx\n", batch_seconds > 0 ? single_seconds / batch_seconds : 0.0);
+    fprintf(stderr, "Mismatched lanes: %d\n", mismatches);
+}
+
 int main(int argc, const char * argv[])
 {
     // We know that a timer parameter can be given via the commandline.
-    // argv[0] contains the program name, so the timer will be after that.
-    int timer = 300;
-    if(argc > 2)
-        timer = std::atoi(argv[2]);
+    // argv[0] contains the program name, so the program files and timer will be
+    // after that; any argument made up only of digits is taken as the timer.
+    // Any arguments starting with "--" are options and may appear anywhere.
+    std::vector<std::string> programs;
+    int timer = 300,
+        prefetch = 0,   // Most prefetches in flight at once (0 when disabled)
+        lanes = 0;      // Copies run side by side by the batch engine (0 when disabled)
+    unsigned seed = time(NULL);
+    bool timing = false,
+         interpret = false,
+         multiprogram = false,
+         aot = false;
+    SCHED_POLICY policy = ROUND_ROBIN;
+    TimingConfig timing_config;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(arg.compare(0, 2, "--") == 0)
+        {
+            // Any of the timing options also turns the timing model on.
+            if(arg == "--interpret")
+                interpret = true;
+            else if(arg == "--aot")
+                aot = true;
+            else if(arg == "--prefetch")
+                prefetch = 4;
+            else if(arg.compare(0, 11, "--prefetch=") == 0)
+            {
+                prefetch = std::atoi(arg.c_str() + 11);
+                if(prefetch <= 0)
+                    logError("Error: --prefetch expects a positive number of outstanding requests!");
+            }
+            else if(arg.compare(0, 8, "--lanes=") == 0)
+            {
+                lanes = std::atoi(arg.c_str() + 8);
+                if(lanes <= 0)
+                    logError("Error: --lanes expects a positive number of copies!");
+            }
+            else if(arg.compare(0, 7, "--seed=") == 0)
+                seed = std::strtoul(arg.c_str() + 7, NULL, 10);
+            else if(arg == "--sched=rr" || arg == "--sched=srf")
+            {
+                policy = (arg == "--sched=rr") ? ROUND_ROBIN : SHORTEST_REMAINING;
+                multiprogram = true;
+            }
+            else if(parseTimingOption(arg, timing_config))
+                timing = true;
+            else
+                logError("Error: Unknown option " + arg);
+        }
+        else if(arg.find_first_not_of("0123456789") == std::string::npos)
+            timer = std::atoi(argv[i]);
+        else
+            programs.push_back(arg);
+    }
+    
+    if(programs.empty())
+        logError("Usage: simpleos <program file>... [timer] [options]");
+    if(programs.size() > 1)
+        multiprogram = true;
+    
+    // The batch engine also keeps memory in this process, and runs each lane
+    // through its own interpreter rather than the CPU.
+    if(lanes)
+    {
+        if(multiprogram || timing || prefetch || aot)
+            logError("Error: --lanes cannot be combined with several programs, timing, prefetching or --aot!");
+        
+        Memory m(-1, -1, programs);
+        runBatch(m.Data(), m.Size(), lanes, timer, seed);
+        return 0;
+    }
+    
+    // A compiled program runs against memory in this process, so there is no
+    // Memory process to fork, nor any channel to prefetch over. Only a single
+    // program is supported, and the timing model is not run since compiled
+    // blocks never report their accesses.
+    if(aot)
+    {
+        if(multiprogram || timing || prefetch)
+            logError("Error: --aot cannot be combined with several programs, timing or prefetching!");
+        
+        Memory m(-1, -1, programs);
+        AotProgram compiled(m.Data(), m.Size());
+        compiled.load();
+        
+        CPU c(-1, -1, timer, NULL, NULL, &compiled);
+        RegisterBuiltinHandlers(c);
+        c.force_interpreter(interpret);
+        c.execute();
+        return 0;
+    }
     
     // Also set up pipes for communicating each direction.
     int mem_to_cpu[2];
@@ -59,13 +271,30 @@ int main(int argc, const char * argv[])
     // When fork() returns 0, it is the child process, or the MEMORY
     else if(child_pid == 0)
     {
-        Memory m(cpu_to_mem[0], mem_to_cpu[1], argv[1]);
+        Memory m(cpu_to_mem[0], mem_to_cpu[1], programs);
         m.Cycle();
     }
     // When pid > 0, it is the parent process, or the CPU
     else
     {
-        CPU c(mem_to_cpu[0], cpu_to_mem[1], timer);
+        TimingModel *model = timing ? new TimingModel(timing_config) : NULL;
+        
+        // Each program runs in the partition that memory loaded it into.
+        Scheduler *scheduler = NULL;
+        if(multiprogram)
+        {
+            scheduler = new Scheduler(policy);
+            for(size_t i = 0; i < programs.size(); i++)
+                scheduler->add(programs[i], i * PARTITION_SIZE, PARTITION_SIZE);
+        }
+        
+        Prefetcher *prefetcher = prefetch ? new Prefetcher(mem_to_cpu[0], cpu_to_mem[1], prefetch) : NULL;
+        CPU c(mem_to_cpu[0], cpu_to_mem[1], timer, model, scheduler, NULL, prefetcher);
+        RegisterBuiltinHandlers(c);
+        c.force_interpreter(interpret);
         c.execute();
+        delete model;
+        delete scheduler;
+        delete prefetcher;
     }
 }
@@ -37,26 +37,27 @@ int parseInt(std::string buf, bool skip_first_char)
     return num;
 }
 
-Memory::Memory(int input_pipe, int output_pipe, std::string program_file_path)
+Memory::Memory(int input_pipe, int output_pipe, const std::vector<std::string> &program_file_paths)
 {
     // When setting up memory, make sure that everything starts empty.
-    for(int i = 0; i < MEM_SIZE; i++)
-        main_mem[i] = 0;
+    main_mem.assign(MEM_SIZE * program_file_paths.size(), 0);
     
     // Also attach the pipe handles.
     in = input_pipe;
     out = output_pipe;
     
-    ReadUserProgram(program_file_path);
+    for(size_t i = 0; i < program_file_paths.size(); i++)
+        ReadUserProgram(program_file_paths[i], i * MEM_SIZE);
 }
 
-void Memory::ReadUserProgram(std::string program_file_path)
+void Memory::ReadUserProgram(std::string program_file_path, int base)
 {
     std::ifstream input;
     input.open(program_file_path);
     if(input.good())
     {
-        // The location that this instruction will be stored in memory
+        // The location that this instruction will be stored in memory,
+        // relative to the start of the program's partition
         int load_address = 0;
         
         //char buffer[BUF_SIZE];
@@ -71,14 +72,15 @@ void Memory::ReadUserProgram(std::string program_file_path)
                  * be stored at. */
                 load_address = parseInt(buffer, true);
             }
-            // Skip any lines that do not contain a valid instruction (must start with int)
-            else if(buffer[0] >= '0' && buffer[0] <= '9')
+            // Skip any lines that do not contain a valid instruction (must start with int),
+            // or that would spill over the end of the program's partition
+            else if(buffer[0] >= '0' && buffer[0] <= '9' && load_address < MEM_SIZE)
             {
                 /* If the line started with a number, it is assumed to
                  * contain a valid instruction. Store it at the current load
                  * address and then advance the load address by one space
                  * in memory. */
-                main_mem[load_address] = parseInt(buffer, false);
+                main_mem[base + load_address] = parseInt(buffer, false);
                 load_address++;
             }
         } // end while(getline)
@@ -0,0 +1,197 @@
+//
+//  prefetch.cpp
+//
+// This file contains the implementation of the Prefetcher. Memory answers
+// requests strictly in order, so replies are read back in the same order
+// that requests were sent, and every outstanding reply is collected before
+// the CPU reads the reply to a request of its own. A data stream is
+// trusted after its stride repeats once; until then nothing is prefetched
+// for it.
+//
+
+#include "prefetch.hpp"
+#include "common_data.hpp"
+
+#include <unistd.h>
+
+Prefetcher::Prefetcher(int input_pipe, int output_pipe, int max_outstanding)
+{
+    for(int i = 0; i < TABLE_SIZE; i++)
+    {
+        _table[i].tag = -1;     // Matches no instruction
+        _table[i].last = 0;
+        _table[i].stride = 0;
+        _table[i].confidence = 0;
+    }
+    for(int i = 0; i < BUFFER_SIZE; i++)
+        _buffer[i].valid = false;
+    _next_slot = 0;
+    _max_outstanding = max_outstanding;
+
+    _in = input_pipe;
+    _out = output_pipe;
+
+    _issued = 0;
+    _useful = 0;
+    _late = 0;
+    _discarded = 0;
+    _demand = 0;
+}
+
+int Prefetcher::_receive()
+{
+    int val;
+    read(_in, &val, sizeof(int));
+    return val;
+}
+
+void Prefetcher::_keep(int addr, int val)
+{
+    // The oldest entry is replaced, whether or not it was ever used.
+    Entry &slot = _buffer[_next_slot];
+    if(slot.valid)
+        _discarded++;
+    slot.addr = addr;
+    slot.val = val;
+    slot.valid = true;
+    _next_slot = (_next_slot + 1) % BUFFER_SIZE;
+}
+
+bool Prefetcher::_tracked(int addr) const
+{
+    for(int i = 0; i < BUFFER_SIZE; i++)
+    {
+        if(_buffer[i].valid && _buffer[i].addr == addr)
+            return true;
+    }
+    for(size_t i = 0; i < _pending.size(); i++)
+    {
+        if(!_pending[i].stale && _pending[i].addr == addr)
+            return true;
+    }
+    return false;
+}
+
+bool Prefetcher::lookup(int addr, int &val)
+{
+    _demand++;
+
+    // A reply that has already arrived is used (and removed) straight away.
+    for(int i = 0; i < BUFFER_SIZE; i++)
+    {
+        if(_buffer[i].valid && _buffer[i].addr == addr)
+        {
+            _buffer[i].valid = false;
+            val = _buffer[i].val;
+            _useful++;
+            return true;
+        }
+    }
+
+    // Otherwise, collect replies in order until the one we want arrives,
+    // keeping the rest for later. Stale replies are thrown away.
+    bool found = false;
+    while(!_pending.empty())
+    {
+        Request request = _pending.front();
+        _pending.pop_front();
+        int reply = _receive();
+        if(request.stale)
+            _discarded++;
+        else if(request.addr == addr)
+        {
+            val = reply;
+            found = true;
+            _useful++;
+            _late++;
+            break;
+        }
+        else
+            _keep(request.addr, reply);
+    }
+    return found;
+}
+
+void Prefetcher::train(int instr_addr, int addr, bool fetch, int lo, int hi, int base)
+{
+    // Fetches only ever move forward one word at a time between branches,
+    // so the next words are always worth requesting.
+    int stride = 1;
+    if(!fetch)
+    {
+        Stream &stream = _table[(unsigned)instr_addr % TABLE_SIZE];
+
+        // A new instruction takes over the entry and starts learning from scratch.
+        if(stream.tag != instr_addr)
+        {
+            stream.tag = instr_addr;
+            stream.last = addr;
+            stream.stride = 0;
+            stream.confidence = 0;
+            return;
+        }
+
+        stride = addr - stream.last;
+        if(stride != 0 && stride == stream.stride)
+            stream.confidence++;
+        else
+        {
+            stream.stride = stride;
+            stream.confidence = 0;
+        }
+        stream.last = addr;
+        if(stream.confidence == 0)
+            return;
+    }
+
+    // Run ahead along the stream for as many requests as the channel allows,
+    // without leaving the range the program is allowed to read.
+    int next = addr;
+    for(int i = 0; i < _max_outstanding && (int)_pending.size() < _max_outstanding; i++)
+    {
+        next += stride;
+        if(next < lo || next >= hi)
+            break;
+        if(_tracked(base + next))
+            continue;
+
+        CMD read_next = READ;
+        int physical = base + next;
+        write(_out, &read_next, sizeof(CMD));
+        write(_out, &physical, sizeof(int));
+        Request request = {physical, false};
+        _pending.push_back(request);
+        _issued++;
+    }
+}
+
+void Prefetcher::invalidate(int addr)
+{
+    for(int i = 0; i < BUFFER_SIZE; i++)
+    {
+        if(_buffer[i].valid && _buffer[i].addr == addr)
+        {
+            _buffer[i].valid = false;
+            _discarded++;
+        }
+    }
+
+    // Requests already sent are answered before the write lands, so their
+    // replies would hold the old value.
+    for(size_t i = 0; i < _pending.size(); i++)
+    {
+        if(_pending[i].addr == addr)
+            _pending[i].stale = true;
+    }
+}
+
+void Prefetcher::report(FILE *out) const
+{
+    fprintf(out, "\n--- Prefetch Report ---\n");
+    fprintf(out, "Demand reads:     %ld\n", _demand);
+    fprintf(out, "Prefetches:       %ld\n", _issued);
+    fprintf(out, "Useful:           %ld (%ld still in flight when needed)\n", _useful, _late);
+    fprintf(out, "Discarded:        %ld\n", _discarded);
+    fprintf(out, "Accuracy:         %.2f%%\n", _issued ? 100.0 * _useful / _issued : 0.0);
+    fprintf(out, "Coverage:         %.2f%%\n", _demand ? 100.0 * _useful / _demand : 0.0);
+}
@@ -0,0 +1,128 @@
+//
+//  scheduler.cpp
+//
+// This file contains the implementation of the Scheduler. Round-robin
+// simply takes the next unfinished process after the current one. The
+// remaining run time of a guest program is not known ahead of time, so
+// shortest-remaining-first ranks processes by the service they have
+// received so far and runs the one with the least, on the assumption that
+// a process which has run briefly is likely to finish soon.
+//
+
+#include "scheduler.hpp"
+#include "cpu.hpp"
+
+Scheduler::Scheduler(SCHED_POLICY policy)
+{
+    _policy = policy;
+    _current = 0;
+    _clock = 0;
+    _switches = 0;
+    clock_gettime(CLOCK_MONOTONIC, &_start);
+}
+
+void Scheduler::add(std::string name, int base, int limit)
+{
+    Process p;
+    p.name = name;
+
+    // These match the registers that the CPU starts with for a single program.
+    p.PC = 0;
+    p.SP = 1000;
+    p.IR = -1;
+    p.AC = 0;
+    p.X = 0;
+    p.Y = 0;
+    p.mode = USER;
+    p.base = base;
+    p.limit = limit;
+
+    p.instructions = 0;
+    p.syscalls = 0;
+    p.preemptions = 0;
+    p.dispatches = 0;
+    p.first_run = -1;
+    p.finish = -1;
+    p.done = false;
+
+    // The first process added is the one running when the CPU starts.
+    if(_table.empty())
+    {
+        p.dispatches = 1;
+        p.first_run = 0;
+    }
+    _table.push_back(p);
+}
+
+Process *Scheduler::next(bool finished)
+{
+    int count = _table.size();
+    Process &old = _table[_current];
+    if(finished)
+    {
+        old.done = true;
+        old.finish = _clock;
+    }
+
+    // Look through the table starting after the current process, so that
+    // ties are broken in round-robin order and the current process is
+    // considered last.
+    int chosen = -1;
+    for(int i = 1; i <= count; i++)
+    {
+        int candidate = (_current + i) % count;
+        if(_table[candidate].done)
+            continue;
+        if(chosen < 0 || (_policy == SHORTEST_REMAINING &&
+                          _table[candidate].instructions < _table[chosen].instructions))
+            chosen = candidate;
+        if(_policy == ROUND_ROBIN)
+            break;
+    }
+    if(chosen < 0)
+        return NULL;
+
+    // Only count a switch when a different process takes over the CPU.
+    if(chosen != _current)
+    {
+        if(!finished)
+            old.preemptions++;
+        _switches++;
+        _current = chosen;
+        _table[chosen].dispatches++;
+        if(_table[chosen].first_run < 0)
+            _table[chosen].first_run = _clock;
+    }
+    return &_table[_current];
+}
+
+void Scheduler::report(FILE *out) const
+{
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - _start.tv_sec) + (end.tv_nsec - _start.tv_nsec) / 1e9;
+
+    fprintf(out, "\n--- Process Report (%s) ---\n",
+            _policy == ROUND_ROBIN ? "round-robin" : "shortest-remaining-first");
+    fprintf(out, "%-4s %-20s %12s %8s %8s %8s %10s %12s %12s\n", "PID", "Program", "Instructions",
+            "Syscalls", "Preempts", "Dispatch", "Response", "Turnaround", "Waiting");
+
+    double total_turnaround = 0, total_waiting = 0;
+    for(size_t i = 0; i < _table.size(); i++)
+    {
+        // Every process arrives at time 0, so turnaround is simply its finish time.
+        const Process &p = _table[i];
+        long waiting = p.finish - p.instructions;
+        fprintf(out, "%-4zu %-20s %12ld %8ld %8ld %8ld %10ld %12ld %12ld\n", i, p.name.c_str(),
+                p.instructions, p.syscalls, p.preemptions, p.dispatches, p.first_run, p.finish, waiting);
+        total_turnaround += p.finish;
+        total_waiting += waiting;
+    }
+
+    fprintf(out, "Total instructions:  %ld\n", _clock);
+    fprintf(out, "Context switches:    %ld\n", _switches);
+    fprintf(out, "Avg turnaround:      %.1f\n", total_turnaround / _table.size());
+    fprintf(out, "Avg waiting:         %.1f\n", total_waiting / _table.size());
+    fprintf(out, "Throughput:          %.0f instructions/sec (%.3f s)\n",
+            seconds > 0 ? _clock / seconds : 0.0, seconds);
+}
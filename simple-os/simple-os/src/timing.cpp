@@ -0,0 +1,166 @@
+//
+//  timing.cpp
+//
+// This file contains the implementations of the Cache and TimingModel
+// classes. Caches are set-associative with LRU replacement and allocate a
+// line on every miss, whether the access was a read or a write. A lookup
+// always pays the latency of the level it reaches, so an access that
+// misses both levels costs L1 + L2 + memory latency.
+//
+
+#include "timing.hpp"
+
+TimingConfig::TimingConfig()
+{
+    // 256 words of L1 in 4-word lines, 2-way set associative.
+    l1.size = 256;
+    l1.line_size = 4;
+    l1.ways = 2;
+    l1.latency = 1;
+
+    // 1024 words of L2 in 8-word lines, 4-way set associative.
+    l2.size = 1024;
+    l2.line_size = 8;
+    l2.ways = 4;
+    l2.latency = 10;
+
+    mem_latency = 100;
+    interrupt_cost = 20;
+
+    class_cycles[ALU_OP] = 1;
+    class_cycles[MEM_OP] = 1;
+    class_cycles[BRANCH_OP] = 2;
+    class_cycles[STACK_OP] = 1;
+    class_cycles[IO_OP] = 5;
+    class_cycles[SYS_OP] = 1;
+}
+
+Cache::Cache(const CacheConfig &config)
+{
+    _config = config;
+    _clock = 0;
+    hits = 0;
+    misses = 0;
+
+    // A level with no capacity simply has no sets, and is skipped by the model.
+    _sets = 0;
+    if(config.size > 0 && config.line_size > 0 && config.ways > 0)
+        _sets = config.size / (config.line_size * config.ways);
+
+    _tags.assign(_sets * config.ways, -1);
+    _stamps.assign(_sets * config.ways, 0);
+}
+
+bool Cache::access(int addr)
+{
+    // Whole lines are tracked, so the tag is simply the line number.
+    int line = (unsigned)addr / _config.line_size;
+    int base = (line % _sets) * _config.ways;
+    _clock++;
+
+    // Look for the line in its set, remembering the least recently used way.
+    int victim = base;
+    for(int way = base; way < base + _config.ways; way++)
+    {
+        if(_tags[way] == line)
+        {
+            _stamps[way] = _clock;
+            hits++;
+            return true;
+        }
+        if(_stamps[way] < _stamps[victim])
+            victim = way;
+    }
+
+    // On a miss, the line replaces the least recently used way in the set.
+    _tags[victim] = line;
+    _stamps[victim] = _clock;
+    misses++;
+    return false;
+}
+
+TimingModel::TimingModel(const TimingConfig &config) : _l1(config.l1), _l2(config.l2)
+{
+    _config = config;
+    _cycles = 0;
+    _instructions = 0;
+    _interrupts = 0;
+}
+
+void TimingModel::access(int addr)
+{
+    // Walk down the hierarchy until a level holds the line.
+    if(_l1.enabled())
+    {
+        _cycles += _l1.latency();
+        if(_l1.access(addr))
+            return;
+    }
+    if(_l2.enabled())
+    {
+        _cycles += _l2.latency();
+        if(_l2.access(addr))
+            return;
+    }
+    _cycles += _config.mem_latency;
+}
+
+void TimingModel::retire(int instr)
+{
+    _cycles += _config.class_cycles[classify(instr)];
+    _instructions++;
+}
+
+void TimingModel::interrupt()
+{
+    _cycles += _config.interrupt_cost;
+    _interrupts++;
+}
+
+OP_CLASS TimingModel::classify(int instr)
+{
+    switch(instr)
+    {
+        case Load_Val: case Load_Addr: case LoadInd_Addr: case LoadIdxX_Addr:
+        case LoadIdxY_Addr: case LoadSpX: case Store_Addr:
+            return MEM_OP;
+
+        case Jump_Addr: case JumpIfEqual_Addr: case JumpIfNotEqual_Addr:
+        case Call_Addr: case Ret:
+            return BRANCH_OP;
+
+        case Push: case Pop:
+            return STACK_OP;
+
+        case Get: case Put_Port:
+            return IO_OP;
+
+        case Int: case IRet: case End:
+            return SYS_OP;
+
+        // Everything else only moves values between registers.
+        default:
+            return ALU_OP;
+    }
+}
+
+void TimingModel::report(FILE *out) const
+{
+    fprintf(out, "\n--- Timing Report ---\n");
+    fprintf(out, "Instructions: %ld\n", _instructions);
+    fprintf(out, "Cycles:       %ld\n", _cycles);
+    fprintf(out, "CPI:          %.3f\n", _instructions ? (double)_cycles / _instructions : 0.0);
+    fprintf(out, "Interrupts:   %ld\n", _interrupts);
+
+    // Only report the levels that were actually simulated.
+    const Cache *levels[] = {&_l1, &_l2};
+    const char *names[] = {"L1", "L2"};
+    for(int i = 0; i < 2; i++)
+    {
+        if(!levels[i]->enabled())
+            continue;
+        long total = levels[i]->hits + levels[i]->misses;
+        fprintf(out, "%s miss rate: %.2f%% (%ld/%ld)\n", names[i],
+                total ? 100.0 * levels[i]->misses / total : 0.0, levels[i]->misses, total);
+    }
+}